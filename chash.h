@@ -0,0 +1,101 @@
+// consistent hash ring.
+
+#ifndef chash_h
+#define chash_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include "lang/verify.h"
+
+// Maps 64-bit keys to nodes. Every node is placed on the ring at several
+// points, and a key belongs to the first point at or after its own hash,
+// so adding or removing a node only moves the keys next to its points.
+// The hashes are fixed (FNV-1a plus a final mix), hence every process that builds a ring
+// from the same nodes agrees on the mapping.
+
+class chash {
+ private:
+  static const int VNODES = 64;   // points per node
+
+  std::map<unsigned int, std::string> ring;
+
+  static unsigned int hash(const char *p, size_t n) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+      h = (h ^ (unsigned char) p[i]) * 16777619u;
+    }
+    // FNV-1a alone clusters similar inputs such as "3772#1" and "3772#2";
+    // finish with the murmur3 mixer to spread them over the ring.
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+  }
+
+ public:
+  chash() { }
+
+  chash(const std::vector<std::string> &nodes) {
+    for (unsigned int i = 0; i < nodes.size(); ++i) {
+      add(nodes[i]);
+    }
+  }
+
+  void add(const std::string &node) {
+    for (int i = 0; i < VNODES; ++i) {
+      std::string v = node + "#" + std::to_string(i);
+      ring[hash(v.data(), v.size())] = node;
+    }
+  }
+
+  void remove(const std::string &node) {
+    std::map<unsigned int, std::string>::iterator it = ring.begin();
+    while (it != ring.end()) {
+      if (it->second == node) {
+        ring.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  const std::string &lookup(unsigned long long key) const {
+    VERIFY(!ring.empty());
+
+    std::map<unsigned int, std::string>::const_iterator it;
+    char b[8];
+
+    for (int i = 0; i < 8; ++i) {
+      b[i] = (key >> (56 - 8 * i)) & 0xff;
+    }
+
+    it = ring.lower_bound(hash(b, sizeof(b)));
+    if (it == ring.end()) {
+      it = ring.begin();
+    }
+    return it->second;
+  }
+
+  // Split a comma-separated list of nodes, e.g. "3772,3774".
+  static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> nodes;
+    size_t begin = 0;
+
+    while (begin <= s.size()) {
+      size_t end = s.find(',', begin);
+      if (end == std::string::npos) {
+        end = s.size();
+      }
+      if (end > begin) {
+        nodes.push_back(s.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+    return nodes;
+  }
+};
+
+#endif
@@ -48,7 +48,7 @@ heartbeatthread(void *x)
 }
 
 config::config(std::string _first, std::string _me, config_view_change *_vc)
-  : myvid (0), first (_first), me (_me), vc (_vc)
+  : myvid (0), first (_first), me (_me), vc (_vc), last_acked(0)
 {
   VERIFY(pthread_mutex_init(&cfg_mutex, NULL) == 0);
   VERIFY(pthread_cond_init(&config_cond, NULL) == 0);
@@ -305,6 +305,7 @@ config::heartbeat(std::string m, unsigned vid, int &r)
   tprintf("heartbeat from %s(%d) myvid %d\n", m.c_str(), vid, myvid);
 
   if (vid == myvid) {
+    last_acked = time(NULL);
     ret = paxos_protocol::OK;
   } else if (pro->isrunning()) {
     VERIFY(vid == myvid + 1 || vid + 1 == myvid);
@@ -354,3 +355,27 @@ config::doheartbeat(std::string m)
 
   return res;
 }
+
+bool
+config::renew(std::string m, unsigned vid)
+{
+  int ret = rpc_const::timeout_failure;
+  int r = 0;
+  handle h(m);
+
+  rpcc *cl = h.safebind();
+  if (cl) {
+    ret = cl->call(paxos_protocol::heartbeat, me, vid, r, rpcc::to(1000));
+  }
+
+  // @m also answers OK from a neighbouring view while Paxos is running,
+  // but then it made no promise about view @vid.
+  return ret == paxos_protocol::OK && (unsigned) r == vid;
+}
+
+time_t
+config::acked()
+{
+  ScopedLock ml(&cfg_mutex);
+  return last_acked;
+}
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <time.h>
 #include "paxos.h"
 
 class config_view_change {
@@ -22,6 +23,7 @@ class config : public paxos_change {
   std::string me;
   config_view_change *vc;
   std::vector<std::string> mems;
+  time_t last_acked;  // when this node last answered a heartbeat in its view
 
   pthread_mutex_t cfg_mutex;
   pthread_cond_t heartbeat_cond;
@@ -57,6 +59,17 @@ class config : public paxos_change {
   bool add(std::string, unsigned vid);
   bool ismember(std::string m, unsigned vid);
   void heartbeater(void);
+
+  // The primary of the RSM holds a lease on its view while every other
+  // member answers its heartbeats: a node that answers a heartbeat in its
+  // current view promises not to take over as primary for lease_time
+  // seconds. renew() sends such a heartbeat to @m for view @vid and
+  // returns true if @m answered in that view; acked() tells when this
+  // node last answered one.
+  static const unsigned int lease_time = 3;
+  bool renew(std::string m, unsigned vid);
+  time_t acked();
+
   void paxos_commit(unsigned instance, std::string v);
 };
 
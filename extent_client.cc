@@ -1,21 +1,287 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include <algorithm>
 #include <sstream>
 #include <iostream>
+#include <vector>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 
 // The calls assume that the caller holds a lock on the extent.
 
-extent_client::extent_client(std::string dst)
+const size_t extent_client::DEFAULT_BUDGET;
+const unsigned int extent_client::DEFAULT_WRITEBACK_AGE;
+const size_t extent_client::DEFAULT_DIRTY_LIMIT;
+const unsigned int extent_client::HOLE_SIZE;
+
+static void *
+writebackthread(void *x)
+{
+  extent_client *ec = (extent_client *) x;
+  ec->writebacker();
+  return 0;
+}
+
+extent_client::extent_client(std::string dst, size_t budget)
+  : budget(budget), cached_bytes(0), hand(0), lu(NULL),
+    writeback_age(DEFAULT_WRITEBACK_AGE), dirty_limit(DEFAULT_DIRTY_LIMIT),
+    dirty_bytes(0)
+{
+  std::vector<std::string> nodes = chash::split(dst);
+
+  for (unsigned int i = 0; i < nodes.size(); ++i) {
+    sockaddr_in dstsock;
+    make_sockaddr(nodes[i].c_str(), &dstsock);
+
+    rpcc *c = new rpcc(dstsock);
+    if (c->bind() != 0) {
+      printf("extent_client: bind to %s failed\n", nodes[i].c_str());
+    }
+    servers[nodes[i]] = c;
+    ring.add(nodes[i]);
+  }
+  VERIFY(!servers.empty());
+
+  counters.hits = 0;
+  counters.misses = 0;
+  counters.evictions = 0;
+  counters.writebacks = 0;
+
+  pthread_mutex_init(&m, NULL);
+  pthread_cond_init(&writeback_c, NULL);
+}
+
+// Write-back needs the lock user to keep other threads off the extents.
+void
+extent_client::start_writeback(unsigned int age, size_t limit)
+{
+  VERIFY(lu != NULL);
+
+  writeback_age = age;
+  dirty_limit = limit;
+
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, &writebackthread, (void *) this) == 0);
+}
+
+// The extent server that stores @eid.
+rpcc *
+extent_client::cl(extent_protocol::extentid_t eid)
+{
+  // servers and ring do not change after the constructor, so no lock.
+  return servers.find(ring.lookup(eid))->second;
+}
+
+extent_client::cache_stats
+extent_client::stats()
+{
+  ScopedLock ml(&m);
+
+  cache_stats st = counters;
+
+  st.bytes = cached_bytes;
+  st.dirty_bytes = dirty_bytes;
+  st.entries = exts_cache.size();
+  return st;
+}
+
+// Entries stay put in exts_cache until the holder of the extent's lock
+// erases them, so the pointer stays valid without m.
+extent_client::extent_t *
+extent_client::find(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&m);
+
+  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+  it = exts_cache.find(eid);
+  if (it == exts_cache.end()) {
+    return NULL;
+  }
+  return &it->second;
+}
+
+extent_client::extent_t &
+extent_client::insert(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&m);
+
+  return exts_cache[eid];
+}
+
+void
+extent_client::hit(extent_t &ext)
+{
+  ScopedLock ml(&m);
+
+  ext.referenced = true;
+  counters.hits += 1;
+}
+
+void
+extent_client::miss()
+{
+  ScopedLock ml(&m);
+
+  counters.misses += 1;
+}
+
+// Content may be shared with extent_bufs handed out by get and
+// read_range; copy it before the first change.
+std::string &
+extent_client::writable(std::shared_ptr<std::string> &ext)
+{
+  if (!ext) {
+    ext = std::make_shared<std::string>();
+  } else if (ext.use_count() > 1) {
+    ext = std::make_shared<std::string>(*ext);
+  }
+  return *ext;
+}
+
+// Recompute the memory used by @ext and mark it referenced.
+void
+extent_client::charge(extent_t &ext)
+{
+  size_t bytes = ext.ext ? ext.ext->size() : 0;
+  bool dirty;
+  std::map<unsigned int, std::string>::iterator rit;
+
+  for (rit = ext.ranges.begin(); rit != ext.ranges.end(); ++rit) {
+    bytes += rit->second.size();
+  }
+
+  // Removed extents are left for flush, there is nothing to write back.
+  if (ext.removed) {
+    dirty = false;
+  } else if (ext.full) {
+    dirty = ext.dirty;
+  } else {
+    dirty = ext.resized || !ext.ranges.empty();
+  }
+
+  ScopedLock ml(&m);
+
+  cached_bytes = cached_bytes - ext.bytes + sizeof(ext) + bytes;
+  ext.bytes = sizeof(ext) + bytes;
+
+  dirty_bytes -= ext.dirty_bytes;
+  ext.dirty_bytes = dirty ? bytes : 0;
+  dirty_bytes += ext.dirty_bytes;
+
+  if (!dirty) {
+    ext.dirty_since = 0;
+  } else if (ext.dirty_since == 0) {
+    ext.dirty_since = time_since_epoch();
+  }
+  if (dirty_bytes > dirty_limit) {
+    pthread_cond_signal(&writeback_c);
+  }
+
+  ext.referenced = true;
+}
+
+void
+extent_client::erase(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&m);
+
+  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+  it = exts_cache.find(eid);
+  if (it != exts_cache.end()) {
+    cached_bytes -= it->second.bytes;
+    dirty_bytes -= it->second.dirty_bytes;
+    exts_cache.erase(it);
+  }
+}
+
+// Switch a whole cached extent to caching dirty ranges only. A dirty
+// extent is put first, since it may not exist on the server yet; after
+// that the server has the same content and nothing needs to be kept.
+extent_protocol::status
+extent_client::unfill(extent_protocol::extentid_t eid, extent_t &ext)
+{
+  if (ext.dirty) {
+    extent_protocol::status ret;
+    int r;
+
+    ret = cl(eid)->call(extent_protocol::put, eid, *ext.ext, r);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  ext.ranges.clear();
+  ext.base_size = ext.ext->size();
+  ext.resized = false;
+  ext.ext.reset();
+  ext.full = false;
+  ext.dirty = false;
+
+  return extent_protocol::OK;
+}
+
+// Evict entries until the cache fits its budget. @keep is the extent the
+// caller is working on. Dirty entries are written back by the flush that
+// the lock user triggers when it releases the lock.
+void
+extent_client::evict(extent_protocol::extentid_t keep)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_protocol::extentid_t eid;
+  size_t n;
+
+  {
+    ScopedLock ml(&m);
+
+    // Two turns of the hand clear every reference bit; after that the
+    // remaining entries are all in use.
+    n = 2 * exts_cache.size();
+  }
+
+  while (true) {
+    {
+      ScopedLock ml(&m);
+
+      while (true) {
+        if (cached_bytes <= budget || n == 0) {
+          return;
+        }
+        n -= 1;
+
+        it = exts_cache.lower_bound(hand);
+        if (it == exts_cache.end()) {
+          it = exts_cache.begin();
+        }
+
+        eid = it->first;
+        hand = eid + 1;
+
+        if (it->second.referenced) {
+          it->second.referenced = false;
+        } else if (eid != keep) {
+          break;
+        }
+      }
+    }
+
+    if (lu != NULL) {
+      if (!lu->evict(eid)) {
+        continue;
+      }
+    } else if (flush(eid) != extent_protocol::OK) {
+      continue;
+    }
+
+    ScopedLock ml(&m);
+
+    if (exts_cache.find(eid) == exts_cache.end()) {
+      counters.evictions += 1;
+    }
   }
 }
 
@@ -23,25 +289,52 @@ extent_protocol::status
 extent_client::get_impl(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret;
+  extent_protocol::getallres res;
 
-  std::string buf;
-  extent_protocol::attr attr;
-
-  ret = cl->call(extent_protocol::get, eid, buf);
+  miss();
+  ret = cl(eid)->call(extent_protocol::getall, eid, res);
   if (ret != extent_protocol::OK) {
     return ret;
   }
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+
+  extent_client::extent_t &ext = insert(eid);
+
+  ext.ext = std::make_shared<std::string>(std::move(res.buf));
+  ext.attr = res.a;
+  ext.full = true;
+  ext.dirty = false;
+  ext.removed = false;
+  ext.ranges.clear();
+  ext.resized = false;
+  charge(ext);
+
+  return extent_protocol::OK;
+}
+
+// Cache the attributes only, the content is fetched by range on demand.
+extent_protocol::status
+extent_client::getattr_impl(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret;
+  extent_protocol::attr attr;
+
+  miss();
+  ret = cl(eid)->call(extent_protocol::getattr, eid, attr);
   if (ret != extent_protocol::OK) {
     return ret;
   }
 
-  extent_client::extent_t &ext = exts_cache[eid];
+  extent_client::extent_t &ext = insert(eid);
 
-  ext.ext = buf;
+  ext.ext.reset();
   ext.attr = attr;
+  ext.full = false;
   ext.dirty = false;
   ext.removed = false;
+  ext.ranges.clear();
+  ext.base_size = attr.size;
+  ext.resized = false;
+  charge(ext);
 
   return extent_protocol::OK;
 }
@@ -50,18 +343,64 @@ extent_protocol::status
 extent_client::put_impl(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret;
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_t *ext;
   int r;
 
-  it = exts_cache.find(eid);
-  VERIFY(it != exts_cache.end() && !it->second.removed && it->second.dirty);
+  ext = find(eid);
+  VERIFY(ext != NULL && !ext->removed && ext->full && ext->dirty);
 
-  ret = cl->call(extent_protocol::put, eid, std::move(it->second.ext), r);
+  ret = cl(eid)->call(extent_protocol::put, eid, *ext->ext, r);
   if (ret != extent_protocol::OK) {
     return ret;
   }
 
-  exts_cache.erase(it);
+  erase(eid);
+
+  return extent_protocol::OK;
+}
+
+// Write back the dirty ranges of a partially cached extent. A shrinking
+// resize is replayed first so that the truncated tail reads as zeros.
+extent_protocol::status
+extent_client::put_ranges_impl(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret;
+  std::map<unsigned int, std::string>::iterator rit;
+  unsigned int end;
+  int r;
+
+  extent_t *e = find(eid);
+  VERIFY(e != NULL && !e->removed && !e->full);
+
+  extent_t &ext = *e;
+
+  if (ext.resized) {
+    ret = cl(eid)->call(extent_protocol::resize, eid, ext.base_size, r);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  end = ext.base_size;
+  for (rit = ext.ranges.begin(); rit != ext.ranges.end(); ++rit) {
+    ret = cl(eid)->call(extent_protocol::write_range, eid, rit->first, rit->second, r);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    end = std::max(end, (unsigned int) (rit->first + rit->second.size()));
+  }
+
+  if (end != ext.attr.size) {
+    ret = cl(eid)->call(extent_protocol::resize, eid, ext.attr.size, r);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  ext.ranges.clear();
+  ext.base_size = ext.attr.size;
+  ext.resized = false;
+  charge(ext);
 
   return extent_protocol::OK;
 }
@@ -70,45 +409,157 @@ extent_protocol::status
 extent_client::remove_impl(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret;
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_t *ext;
   int r;
 
-  it = exts_cache.find(eid);
-  VERIFY(it != exts_cache.end() && it->second.removed);
+  ext = find(eid);
+  VERIFY(ext != NULL && ext->removed);
 
-  ret = cl->call(extent_protocol::remove, eid, r);
+  ret = cl(eid)->call(extent_protocol::remove, eid, r);
   if (ret != extent_protocol::OK) {
     return ret;
   }
 
-  exts_cache.erase(it);
+  erase(eid);
+
+  return extent_protocol::OK;
+}
+
+// Write a dirty extent back but keep it cached.
+extent_protocol::status
+extent_client::writeback_impl(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret;
+  extent_t *ext;
+  int r;
+
+  ext = find(eid);
+  if (ext == NULL || ext->removed) {
+    return extent_protocol::OK;
+  }
+
+  if (ext->full) {
+    if (!ext->dirty) {
+      return extent_protocol::OK;
+    }
+    ret = cl(eid)->call(extent_protocol::put, eid, *ext->ext, r);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    ext->dirty = false;
+    charge(*ext);
+  } else if (ext->resized || !ext->ranges.empty()) {
+    ret = put_ranges_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  } else {
+    return extent_protocol::OK;
+  }
+
+  ScopedLock ml(&m);
+
+  counters.writebacks += 1;
 
   return extent_protocol::OK;
 }
 
+void
+extent_client::writebacker()
+{
+  ScopedLock ml(&m);
+
+  while (true) {
+    struct timeval now;
+    struct timespec next;
+
+    gettimeofday(&now, NULL);
+    next.tv_sec = now.tv_sec + 1;
+    next.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&writeback_c, &m, &next);
+
+    // Oldest first, so that the dirty limit is met by writing back the
+    // extents that have waited longest.
+    std::vector<std::pair<unsigned int, extent_protocol::extentid_t> > dirty;
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+    unsigned int t = time_since_epoch();
+
+    for (it = exts_cache.begin(); it != exts_cache.end(); ++it) {
+      if (it->second.dirty_since != 0) {
+        dirty.push_back(std::make_pair(it->second.dirty_since, it->first));
+      }
+    }
+    std::sort(dirty.begin(), dirty.end());
+
+    for (unsigned int i = 0; i < dirty.size(); ++i) {
+      if (t - dirty[i].first < writeback_age && dirty_bytes <= dirty_limit) {
+        break;
+      }
+
+      extent_protocol::extentid_t eid = dirty[i].second;
+
+      pthread_mutex_unlock(&m);
+      // Extents that are in use are written back on a later pass.
+      if (lu->try_lock(eid)) {
+        if (writeback_impl(eid) != extent_protocol::OK) {
+          printf("extent_client: write-back of extent %lld failed.\n", eid);
+        }
+        lu->unlock(eid);
+      }
+      pthread_mutex_lock(&m);
+    }
+  }
+}
+
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_buf b;
+  extent_protocol::status ret = get(eid, b);
 
-  it = exts_cache.find(eid);
-  if (it != exts_cache.end()) { // Cache hit
-    if (it->second.removed) {
+  if (ret == extent_protocol::OK) {
+    buf.assign(b.data(), b.size());
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, extent_buf &buf)
+{
+  extent_t *ext = find(eid);
+
+  if (ext != NULL && ext->full) { // Cache hit
+    if (ext->removed) {
       return extent_protocol::IOERR;
     }
-    it->second.attr.atime = time_since_epoch();
-    buf = it->second.ext;
+    hit(*ext);
+    ext->attr.atime = time_since_epoch();
+    buf = extent_buf(ext->ext, 0, ext->ext->size());
 
     return extent_protocol::OK;
   }
 
-  extent_protocol::status ret = get_impl(eid);
+  extent_protocol::status ret;
+
+  if (ext != NULL) { // Only partially cached.
+    if (ext->removed) {
+      return extent_protocol::IOERR;
+    }
+    ret = put_ranges_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  ret = get_impl(eid);
   if (ret != extent_protocol::OK) {
     return ret;
   }
 
-  exts_cache[eid].attr.atime = time_since_epoch();
-  buf = exts_cache[eid].ext;
+  ext = find(eid);
+  ext->attr.atime = time_since_epoch();
+  buf = extent_buf(ext->ext, 0, ext->ext->size());
+  evict(eid);
 
   return extent_protocol::OK;
 }
@@ -117,24 +568,77 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr &attr)
 {
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_t *ext = find(eid);
 
-  it = exts_cache.find(eid);
-  if (it != exts_cache.end()) { // Cache hit
-    if (it->second.removed) {
+  if (ext != NULL) { // Cache hit
+    if (ext->removed) {
       return extent_protocol::IOERR;
     }
-    attr = it->second.attr;
+    hit(*ext);
+    attr = ext->attr;
 
     return extent_protocol::OK;
   }
 
-  extent_protocol::status ret = get_impl(eid);
+  extent_protocol::status ret = getattr_impl(eid);
   if (ret != extent_protocol::OK) {
     return ret;
   }
 
-  attr = exts_cache[eid].attr;
+  attr = find(eid)->attr;
+  evict(eid);
+
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::getattr_multi(
+    const std::vector<extent_protocol::extentid_t> &eids,
+    std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs)
+{
+  std::map<std::string, std::vector<extent_protocol::extentid_t> > batches;
+  std::map<std::string, std::vector<extent_protocol::extentid_t> >::iterator it;
+
+  attrs.clear();
+
+  for (unsigned int i = 0; i < eids.size(); ++i) {
+    extent_protocol::extentid_t eid = eids[i];
+
+    // A cached extent may be newer than its copy on the server. Its
+    // attributes are read under its lock, which the cache only holds on
+    // to while the extent is cached; one in use by another thread is
+    // looked up on the server.
+    if (find(eid) != NULL && (lu == NULL || lu->try_lock(eid))) {
+      extent_t *ext = find(eid);
+      bool cached = ext != NULL;
+
+      if (cached && !ext->removed) {
+        hit(*ext);
+        attrs[eid] = ext->attr;
+      }
+      if (lu != NULL) {
+        lu->unlock(eid);
+      }
+      if (cached) {
+        continue;
+      }
+    }
+
+    batches[ring.lookup(eid)].push_back(eid);
+  }
+
+  for (it = batches.begin(); it != batches.end(); ++it) {
+    std::map<extent_protocol::extentid_t, extent_protocol::attr> res;
+    extent_protocol::status ret;
+
+    miss();
+    ret = servers.find(it->first)->second->call(extent_protocol::getattr_multi,
+                                                it->second, res);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    attrs.insert(res.begin(), res.end());
+  }
 
   return extent_protocol::OK;
 }
@@ -142,18 +646,21 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
-  extent_t ext;
+  extent_t &ext = insert(eid);
   unsigned int t = time_since_epoch();
 
   ext.attr.size = buf.size();
   ext.attr.atime = t;
   ext.attr.mtime = t;
   ext.attr.ctime = t;
-  ext.ext = std::move(buf);
+  ext.ext = std::make_shared<std::string>(std::move(buf));
+  ext.full = true;
   ext.dirty = true;
   ext.removed = false;
-
-  exts_cache[eid] = std::move(ext);
+  ext.ranges.clear();
+  ext.resized = false;
+  charge(ext);
+  evict(eid);
 
   return extent_protocol::OK;
 }
@@ -161,7 +668,249 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
-  exts_cache[eid].removed = true;
+  extent_t &ext = insert(eid);
+
+  // The content is never read again, only the remove is written back.
+  ext.removed = true;
+  ext.ext.reset();
+  ext.ranges.clear();
+  charge(ext);
+
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int len, std::string &buf)
+{
+  extent_buf b;
+  extent_protocol::status ret = read_range(eid, off, len, b);
+
+  if (ret == extent_protocol::OK) {
+    buf.assign(b.data(), b.size());
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int len, extent_buf &buf)
+{
+  extent_protocol::status ret;
+  extent_t *e = find(eid);
+
+  if (e == NULL) {
+    ret = getattr_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    e = find(eid);
+  } else {
+    hit(*e);
+  }
+
+  extent_t &ext = *e;
+
+  if (ext.removed) {
+    return extent_protocol::IOERR;
+  }
+
+  ext.attr.atime = time_since_epoch();
+
+  // Adjust the range to fit the extent.
+  if (off >= ext.attr.size) {
+    buf = extent_buf();
+    evict(eid);
+    return extent_protocol::OK;
+  }
+  len = std::min(len, ext.attr.size - off);
+
+  if (ext.full) {
+    buf = extent_buf(ext.ext, off, len);
+    return extent_protocol::OK;
+  }
+
+  // Bytes below base_size come from the server, the rest are zeros, and
+  // dirty ranges are laid over both.
+  std::map<unsigned int, std::string>::iterator rit = ext.ranges.upper_bound(off);
+  if (rit != ext.ranges.begin()) {
+    --rit;
+  }
+
+  bool covered = rit != ext.ranges.end() && rit->first <= off &&
+                 rit->first + rit->second.size() >= off + len;
+  std::string data;
+
+  if (!covered && off < ext.base_size) {
+    miss();
+    ret = cl(eid)->call(extent_protocol::read_range, eid, off,
+                   std::min(len, ext.base_size - off), data);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+  data.resize(len);
+
+  for (; rit != ext.ranges.end() && rit->first < off + len; ++rit) {
+    unsigned int begin = std::max(off, rit->first);
+    unsigned int end = std::min(off + len, (unsigned int) (rit->first + rit->second.size()));
+
+    if (begin < end) {
+      data.replace(begin - off, end - begin, rit->second, begin - rit->first, end - begin);
+    }
+  }
+  buf = extent_buf(std::move(data));
+  evict(eid);
+
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid, unsigned int off,
+                           std::string buf)
+{
+  extent_protocol::status ret;
+  extent_t *e = find(eid);
+
+  if (e == NULL) {
+    ret = getattr_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    e = find(eid);
+  } else {
+    hit(*e);
+  }
+
+  extent_t &ext = *e;
+  unsigned int t = time_since_epoch();
+  unsigned int end = off + buf.size();
+
+  if (ext.removed) {
+    return extent_protocol::IOERR;
+  }
+
+  if (ext.full && off > ext.ext->size() + HOLE_SIZE) {
+    ret = unfill(eid, ext);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  ext.attr.size = std::max(ext.attr.size, end);
+  ext.attr.mtime = t;
+  ext.attr.ctime = t;
+
+  if (ext.full) {
+    std::string &data = writable(ext.ext);
+
+    if (data.size() < end) {
+      data.resize(end);
+    }
+    data.replace(off, buf.size(), buf);
+    ext.dirty = true;
+    charge(ext);
+    evict(eid);
+
+    return extent_protocol::OK;
+  }
+
+  // Merge [off, end) with the dirty ranges it overlaps or touches.
+  std::map<unsigned int, std::string>::iterator first, last;
+
+  first = ext.ranges.upper_bound(off);
+  if (first != ext.ranges.begin()) {
+    std::map<unsigned int, std::string>::iterator prev = first;
+    --prev;
+    if (prev->first + prev->second.size() >= off) {
+      first = prev;
+    }
+  }
+  last = ext.ranges.upper_bound(end);
+
+  if (first != last) {
+    std::map<unsigned int, std::string>::iterator tail = last;
+    --tail;
+
+    unsigned int tail_end = tail->first + tail->second.size();
+
+    if (first->first < off) {
+      buf.insert(0, first->second, 0, off - first->first);
+      off = first->first;
+    }
+    if (tail_end > end) {
+      buf.append(tail->second, end - tail->first, tail_end - end);
+    }
+    ext.ranges.erase(first, last);
+  }
+
+  ext.ranges[off] = std::move(buf);
+  charge(ext);
+  evict(eid);
+
+  return extent_protocol::OK;
+}
+
+// Set the size of the extent, new bytes are filled with '\0'.
+extent_protocol::status
+extent_client::resize(extent_protocol::extentid_t eid, unsigned int size)
+{
+  extent_protocol::status ret;
+  extent_t *e = find(eid);
+
+  if (e == NULL) {
+    ret = getattr_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    e = find(eid);
+  } else {
+    hit(*e);
+  }
+
+  extent_t &ext = *e;
+  unsigned int t = time_since_epoch();
+
+  if (ext.removed) {
+    return extent_protocol::IOERR;
+  }
+
+  if (ext.full && size > ext.ext->size() + HOLE_SIZE) {
+    ret = unfill(eid, ext);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  ext.attr.size = size;
+  ext.attr.mtime = t;
+  ext.attr.ctime = t;
+
+  if (ext.full) {
+    writable(ext.ext).resize(size);
+    ext.dirty = true;
+    charge(ext);
+    evict(eid);
+
+    return extent_protocol::OK;
+  }
+
+  // Drop the dirty bytes beyond the new end.
+  std::map<unsigned int, std::string>::iterator rit = ext.ranges.lower_bound(size);
+  ext.ranges.erase(rit, ext.ranges.end());
+  if (!ext.ranges.empty()) {
+    rit = --ext.ranges.end();
+    if (rit->first + rit->second.size() > size) {
+      rit->second.resize(size - rit->first);
+    }
+  }
+
+  if (size < ext.base_size) {
+    ext.base_size = size;
+  }
+  ext.resized = true;
+  charge(ext);
+  evict(eid);
 
   return extent_protocol::OK;
 }
@@ -171,20 +920,38 @@ extent_client::flush(extent_protocol::extentid_t eid)
 {
   printf("flushing extent %lld.\n", eid);
 
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  extent_t *ext = find(eid);
 
-  it = exts_cache.find(eid);
-  if (it == exts_cache.end()) {
+  if (ext == NULL) {
     return extent_protocol::OK;
   }
 
-  if (it->second.removed) {
+  if (ext->removed) {
     return remove_impl(eid);
-  } else if (it->second.dirty) {
+  } else if (ext->full && ext->dirty) {
     return put_impl(eid);
-  } else {
-    exts_cache.erase(it);
+  } else if (!ext->full && (ext->resized || !ext->ranges.empty())) {
+    extent_protocol::status ret = put_ranges_impl(eid);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
   }
+  erase(eid);
 
   return extent_protocol::OK;
 }
+
+void
+extent_client::discard(extent_protocol::extentid_t eid)
+{
+  printf("discarding extent %lld.\n", eid);
+  erase(eid);
+}
+
+extent_protocol::status
+extent_client::reserve(extent_protocol::extentid_t eid, unsigned int n,
+                       unsigned long long &first)
+{
+  miss();
+  return cl(eid)->call(extent_protocol::reserve, eid, n, first);
+}
@@ -4,41 +4,193 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <memory>
+#include <vector>
 #include "extent_protocol.h"
 #include "rpc.h"
+#include "chash.h"
+
+// Classes that inherit extent_lock_user give the extent client access to
+// the locks that guard its cache entries. Evicting an extent returns the
+// cached lock early, and releasing it flushes and drops the cache entry.
+// The write-back thread takes a cached lock that no one holds to write a
+// dirty extent back while keeping it cached.
+class extent_lock_user {
+ public:
+  // Return false if the extent is in use and cannot be evicted now.
+  virtual bool evict(extent_protocol::extentid_t) = 0;
+  // Return false unless the lock is cached and was free.
+  virtual bool try_lock(extent_protocol::extentid_t) = 0;
+  virtual void unlock(extent_protocol::extentid_t) = 0;
+  virtual ~extent_lock_user() { }
+};
+
+// A read-only slice of extent content. It shares the cached buffer rather
+// than copying it; the cache copies the buffer before changing it while a
+// view still refers to it, so the view never changes.
+class extent_buf {
+ private:
+  std::shared_ptr<const std::string> s;
+  size_t off;
+  size_t len;
+
+ public:
+  extent_buf() : off(0), len(0) { }
+  extent_buf(std::shared_ptr<const std::string> s, size_t off, size_t len)
+    : s(s), off(off), len(len) { }
+  explicit extent_buf(std::string &&buf)
+    : s(std::make_shared<std::string>(std::move(buf))), off(0), len(s->size()) { }
+
+  const char *data() const { return s ? s->data() + off : ""; }
+  size_t size() const { return len; }
+};
 
 class extent_client {
  private:
-  rpcc *cl;
+  // Extents are spread over the extent servers by consistent hashing of
+  // their ids.
+  chash ring;
+  std::map<std::string, rpcc *> servers;
 
   struct extent_t {
-    std::string ext;
+    std::shared_ptr<std::string> ext; // NULL unless full
     extent_protocol::attr attr;
 
-    bool dirty;
+    bool full;      // ext holds the whole extent
+    bool dirty;     // ext should be put back as a whole
     bool removed;
 
-    extent_t() : dirty(false), removed(false) { }
+    // Used when only part of the extent is cached (full == false).
+    std::map<unsigned int, std::string> ranges; // dirty byte ranges by offset
+    unsigned int base_size; // bytes beyond base_size on server are stale
+    bool resized;
+
+    // Protected by m, the fields above by the lock on the extent.
+    size_t bytes;        // memory charged to the cache budget
+    size_t dirty_bytes;  // part of bytes not yet written back
+    unsigned int dirty_since; // 0 if clean
+    bool referenced;     // used since the clock hand last passed
+
+    extent_t()
+      : full(false), dirty(false), removed(false),
+        base_size(0), resized(false),
+        bytes(0), dirty_bytes(0), dirty_since(0), referenced(true) { }
   };
 
   std::map<extent_protocol::extentid_t, extent_t> exts_cache;
 
+  // Entries are evicted by CLOCK once the cached bytes exceed the budget.
+  // The hand sweeps the cache in id order and gives referenced entries a
+  // second chance.
+  size_t budget;
+  size_t cached_bytes;
+  extent_protocol::extentid_t hand;
+  extent_lock_user *lu;
+
+  // The write-back thread writes dirty extents back once they are older
+  // than writeback_age seconds or the cache holds more than dirty_limit
+  // dirty bytes.
+  unsigned int writeback_age;
+  size_t dirty_limit;
+  size_t dirty_bytes;
+  pthread_cond_t writeback_c;
+
+  // Protects exts_cache, the accounting and the counters. It is never held
+  // across an RPC or a call into the lock user.
+  pthread_mutex_t m;
+
  public:
-  extent_client(std::string dst);
+  static const size_t DEFAULT_BUDGET = 64 * 1024 * 1024;
+  static const unsigned int DEFAULT_WRITEBACK_AGE = 5;
+  static const size_t DEFAULT_DIRTY_LIMIT = 16 * 1024 * 1024;
+  // A whole cached extent that grows by more than this is switched to
+  // caching dirty ranges, so the hole is never filled in or sent.
+  static const unsigned int HOLE_SIZE = 64 * 1024;
+
+  struct cache_stats {
+    unsigned long long hits;       // served without an RPC
+    unsigned long long misses;     // needed an RPC to the extent server
+    unsigned long long evictions;
+    unsigned long long writebacks; // done by the write-back thread
+    size_t bytes;
+    size_t dirty_bytes;
+    size_t entries;
+  };
+
+  // @dst is a comma-separated list of extent servers, @budget is the
+  // memory the cache may use in bytes.
+  extent_client(std::string dst, size_t budget = DEFAULT_BUDGET);
+
+  // Without a lock user, victims are flushed directly, which is only safe
+  // if no one else caches locks on the extents, and nothing is written
+  // back in the background.
+  void set_lock_user(extent_lock_user *u) { lu = u; }
+  void start_writeback(unsigned int age = DEFAULT_WRITEBACK_AGE,
+                       size_t limit = DEFAULT_DIRTY_LIMIT);
+  cache_stats stats();
 
   extent_protocol::status get(extent_protocol::extentid_t eid,
                               std::string &buf);
+  extent_protocol::status get(extent_protocol::extentid_t eid,
+                              extent_buf &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                   extent_protocol::attr &a);
+  // Attributes of the extents in @eids that exist, with one RPC per extent
+  // server for those not cached. Unlike getattr, this needs no lock on the
+  // extents and caches nothing; the attributes of an extent that another
+  // client has not yet written back may be out of date.
+  extent_protocol::status getattr_multi(
+      const std::vector<extent_protocol::extentid_t> &eids,
+      std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
 
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned int off, unsigned int len,
+                                     std::string &buf);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned int off, unsigned int len,
+                                     extent_buf &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned int off, std::string buf);
+  extent_protocol::status resize(extent_protocol::extentid_t eid,
+                                 unsigned int size);
+
   extent_protocol::status flush(extent_protocol::extentid_t eid);
+  // Forget the cached extent without writing it back, e.g. because the
+  // lock on it was lost and another client may have changed it since.
+  void discard(extent_protocol::extentid_t eid);
+
+  // Reserve the range [first, first + n) of the counter kept in extent
+  // @eid on its server. The counter is never cached.
+  extent_protocol::status reserve(extent_protocol::extentid_t eid,
+                                  unsigned int n, unsigned long long &first);
+
+  void writebacker();
 
  private:
+  rpcc *cl(extent_protocol::extentid_t eid);
+
+  cache_stats counters;
+
+  static std::string &writable(std::shared_ptr<std::string> &);
+
+  extent_t *find(extent_protocol::extentid_t eid);
+  extent_t &insert(extent_protocol::extentid_t eid);
+  void hit(extent_t &);
+  void miss();
+  void charge(extent_t &);
+  void erase(extent_protocol::extentid_t eid);
+  extent_protocol::status unfill(extent_protocol::extentid_t eid, extent_t &);
+  void evict(extent_protocol::extentid_t keep);
+
   extent_protocol::status get_impl(extent_protocol::extentid_t eid);
+  extent_protocol::status getattr_impl(extent_protocol::extentid_t eid);
   extent_protocol::status put_impl(extent_protocol::extentid_t eid);
+  extent_protocol::status put_ranges_impl(extent_protocol::extentid_t eid);
   extent_protocol::status remove_impl(extent_protocol::extentid_t eid);
+  extent_protocol::status writeback_impl(extent_protocol::extentid_t eid);
 };
 
 #endif
@@ -0,0 +1,353 @@
+// write-ahead log and checkpoint of the extent server.
+
+#include "extent_log.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "slock.h"
+#include "lang/verify.h"
+
+// Length and checksum in front of every record.
+static const size_t HEADER_SZ = 8;
+
+static unsigned int
+checksum(const char *p, size_t n)
+{
+  unsigned int h = 2166136261u; // FNV-1a
+
+  for (size_t i = 0; i < n; ++i) {
+    h = (h ^ (unsigned char) p[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void
+put_u32(std::string &out, unsigned int x)
+{
+  out.push_back((x >> 24) & 0xff);
+  out.push_back((x >> 16) & 0xff);
+  out.push_back((x >> 8) & 0xff);
+  out.push_back(x & 0xff);
+}
+
+static unsigned int
+get_u32(const char *p)
+{
+  const unsigned char *q = (const unsigned char *) p;
+  return (q[0] << 24) | (q[1] << 16) | (q[2] << 8) | q[3];
+}
+
+static void
+sync_dir(std::string dir)
+{
+  int fd = open(dir.c_str(), O_RDONLY);
+  VERIFY(fd >= 0);
+  fsync(fd);
+  close(fd);
+}
+
+extent_log::extent_log(std::string _dir)
+  : dir(_dir), fd(-1), gen(0), fsize(0), next_lsn(1), durable_lsn(0),
+    flushing(false), ckpt_fd(-1), ckpt_gen(0)
+{
+  pthread_mutex_init(&m, NULL);
+  pthread_cond_init(&durable_c, NULL);
+}
+
+extent_log::~extent_log()
+{
+  if (fd >= 0) {
+    sync(next_lsn - 1);
+    close(fd);
+  }
+}
+
+std::string
+extent_log::path(std::string name)
+{
+  return dir + "/" + name;
+}
+
+std::string
+extent_log::logname(unsigned int g)
+{
+  return "log." + std::to_string(g);
+}
+
+void
+extent_log::encode(const record &r, std::string &out)
+{
+  marshall m;
+  m << r.type << r.id << r.off << r.attr << r.data;
+
+  std::string payload = m.str();
+
+  put_u32(out, payload.size());
+  put_u32(out, checksum(payload.data(), payload.size()));
+  out.append(payload);
+}
+
+void
+extent_log::write_all(int fd, const std::string &buf)
+{
+  size_t done = 0;
+
+  while (done < buf.size()) {
+    ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    VERIFY(n > 0);
+    done += n;
+  }
+}
+
+// Apply the records of file @name through @a, reading it through a
+// private mapping. A GEN record stores its generation into @g. Returns
+// the length of the valid prefix of the file.
+size_t
+extent_log::replay_file(std::string name, extent_log_apply *a, unsigned int *g)
+{
+  int rfd = open(path(name).c_str(), O_RDONLY);
+  if (rfd < 0) {
+    return 0;
+  }
+
+  struct stat st;
+  VERIFY(fstat(rfd, &st) == 0);
+
+  size_t len = st.st_size;
+  size_t off = 0;
+  int nrecords = 0;
+
+  if (len == 0) {
+    close(rfd);
+    return 0;
+  }
+
+  char *base = (char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, rfd, 0);
+  VERIFY(base != MAP_FAILED);
+  madvise(base, len, MADV_SEQUENTIAL);
+
+  while (off + HEADER_SZ <= len) {
+    size_t n = get_u32(base + off);
+    unsigned int sum = get_u32(base + off + 4);
+
+    if (off + HEADER_SZ + n > len ||
+        checksum(base + off + HEADER_SZ, n) != sum) {
+      break; // torn write
+    }
+
+    record r;
+    unmarshall u(base + off + HEADER_SZ, n);
+    u >> r.type >> r.id >> r.off >> r.attr >> r.data;
+
+    bool ok = u.okdone();
+    char *b;
+    int sz;
+    u.take_buf(&b, &sz); // the buffer belongs to the mapping.
+
+    if (!ok) {
+      break;
+    }
+
+    if (r.type == GEN) {
+      *g = r.id;
+    } else {
+      a->apply(r);
+    }
+    off += HEADER_SZ + n;
+    nrecords += 1;
+  }
+
+  munmap(base, len);
+  close(rfd);
+
+  printf("extent_log: replayed %d records from %s (%zu of %zu bytes)\n",
+         nrecords, name.c_str(), off, len);
+
+  return off;
+}
+
+void
+extent_log::open_log(unsigned int g, size_t valid)
+{
+  fd = open(path(logname(g)).c_str(), O_WRONLY | O_CREAT, 0644);
+  VERIFY(fd >= 0);
+
+  // Cut off a torn record left by a crash, appends start after it.
+  VERIFY(ftruncate(fd, valid) == 0);
+  VERIFY(lseek(fd, valid, SEEK_SET) == (off_t) valid);
+
+  gen = g;
+  fsize = valid;
+  sync_dir(dir);
+}
+
+void
+extent_log::replay(extent_log_apply *a)
+{
+  ScopedLock ml(&m);
+
+  if (mkdir(dir.c_str(), 0755) != 0) {
+    VERIFY(errno == EEXIST);
+  }
+
+  unsigned int g = 0;
+  replay_file("checkpoint", a, &g);
+
+  std::vector<unsigned int> gens;
+  DIR *d = opendir(dir.c_str());
+  struct dirent *ent;
+
+  VERIFY(d != NULL);
+  while ((ent = readdir(d)) != NULL) {
+    unsigned int n;
+    int len;
+
+    if (sscanf(ent->d_name, "log.%u%n", &n, &len) == 1 &&
+        ent->d_name[len] == '\0') {
+      gens.push_back(n);
+    }
+  }
+  closedir(d);
+
+  std::sort(gens.begin(), gens.end());
+
+  unsigned int last = g;
+  size_t valid = 0;
+
+  for (unsigned int i = 0; i < gens.size(); ++i) {
+    if (gens[i] < g) { // covered by the checkpoint
+      unlink(path(logname(gens[i])).c_str());
+      continue;
+    }
+    valid = replay_file(logname(gens[i]), a, &g);
+    last = gens[i];
+  }
+
+  open_log(last, valid);
+}
+
+unsigned long long
+extent_log::append(const record &r)
+{
+  ScopedLock ml(&m);
+
+  size_t before = pending.size();
+  encode(r, pending);
+  fsize += pending.size() - before;
+
+  return next_lsn++;
+}
+
+void
+extent_log::sync(unsigned long long lsn)
+{
+  ScopedLock ml(&m);
+
+  while (durable_lsn < lsn) {
+    if (flushing) {
+      pthread_cond_wait(&durable_c, &m);
+      continue;
+    }
+
+    // Become the leader: write out everything queued so far, including
+    // the records of the threads waiting behind us.
+    std::string buf;
+    unsigned long long last = next_lsn - 1;
+    int wfd = fd;
+
+    buf.swap(pending);
+    flushing = true;
+
+    VERIFY(pthread_mutex_unlock(&m) == 0);
+    write_all(wfd, buf);
+    VERIFY(fsync(wfd) == 0);
+    VERIFY(pthread_mutex_lock(&m) == 0);
+
+    durable_lsn = std::max(durable_lsn, last);
+    flushing = false;
+    pthread_cond_broadcast(&durable_c);
+  }
+}
+
+// Write out pending inline. Assumes m is held.
+void
+extent_log::flush_wo()
+{
+  while (flushing) {
+    pthread_cond_wait(&durable_c, &m);
+  }
+
+  write_all(fd, pending);
+  VERIFY(fsync(fd) == 0);
+  pending.clear();
+
+  durable_lsn = next_lsn - 1;
+  pthread_cond_broadcast(&durable_c);
+}
+
+size_t
+extent_log::size()
+{
+  ScopedLock ml(&m);
+  return fsize;
+}
+
+unsigned int
+extent_log::rotate()
+{
+  ScopedLock ml(&m);
+
+  flush_wo();
+  close(fd);
+  open_log(gen + 1, 0);
+
+  return gen;
+}
+
+void
+extent_log::checkpoint_begin(unsigned int g)
+{
+  ckpt_fd = open(path("checkpoint.tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  VERIFY(ckpt_fd >= 0);
+  ckpt_gen = g;
+
+  record r;
+  r.type = GEN;
+  r.id = g;
+  checkpoint_add(r);
+}
+
+void
+extent_log::checkpoint_add(const record &r)
+{
+  std::string buf;
+  encode(r, buf);
+  write_all(ckpt_fd, buf);
+}
+
+void
+extent_log::checkpoint_end()
+{
+  VERIFY(fsync(ckpt_fd) == 0);
+  close(ckpt_fd);
+  ckpt_fd = -1;
+
+  VERIFY(rename(path("checkpoint.tmp").c_str(), path("checkpoint").c_str()) == 0);
+  sync_dir(dir);
+
+  for (unsigned int g = ckpt_gen; g > 0; --g) {
+    if (unlink(path(logname(g - 1)).c_str()) != 0) {
+      break;
+    }
+  }
+  printf("extent_log: checkpoint of generation %u done\n", ckpt_gen);
+}
@@ -0,0 +1,100 @@
+// durable storage of the extent server.
+
+#ifndef extent_log_h
+#define extent_log_h
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "extent_protocol.h"
+
+// The extent server keeps its durable state in a data directory holding
+// a checkpoint of all extents and a write-ahead log of the updates made
+// since the checkpoint was taken:
+//
+//   checkpoint   all extents as of the start of log generation G
+//   log.<N>      updates, for every N >= G
+//
+// Each record is stored as a length, a checksum and a marshalled payload,
+// so a torn write at the tail of the log is detected and dropped during
+// replay.
+
+class extent_log {
+ public:
+  enum record_type { GEN = 0, PUT, WRITE, RESIZE, REMOVE };
+
+  struct record {
+    int type;
+    extent_protocol::extentid_t id;
+    unsigned int off;
+    std::string data;
+    extent_protocol::attr attr;  // attributes after the update
+
+    record() : type(GEN), id(0), off(0) { }
+  };
+
+  extent_log(std::string dir);
+  ~extent_log();
+
+  // Feed the checkpoint and then the log to @a, and open the log for
+  // appending. Must be called once before anything else.
+  void replay(class extent_log_apply *a);
+
+  // Queue @r at the end of the log and return its sequence number. The
+  // caller should append in the order it applies the updates.
+  unsigned long long append(const record &r);
+
+  // Block until all records up to @lsn are on disk. Concurrent callers
+  // share a single write and fsync (group commit).
+  void sync(unsigned long long lsn);
+
+  // Size in bytes of the current log file.
+  size_t size();
+
+  // Sync the current log and start a new generation; records appended
+  // afterwards go into the new file. Returns the new generation.
+  unsigned int rotate();
+
+  // Write a new checkpoint for generation @gen (as returned by rotate())
+  // from the records passed to checkpoint_add, then drop the log files
+  // it covers.
+  void checkpoint_begin(unsigned int gen);
+  void checkpoint_add(const record &r);
+  void checkpoint_end();
+
+ private:
+  std::string dir;
+  int fd;                         // current log file
+  unsigned int gen;               // generation of the current log file
+  size_t fsize;
+
+  std::string pending;            // encoded records not written yet
+  unsigned long long next_lsn;
+  unsigned long long durable_lsn;
+  bool flushing;                  // a thread is writing out pending
+
+  int ckpt_fd;
+  unsigned int ckpt_gen;
+
+  pthread_mutex_t m;
+  pthread_cond_t durable_c;
+
+  std::string path(std::string name);
+  std::string logname(unsigned int g);
+  size_t replay_file(std::string name, class extent_log_apply *a,
+                     unsigned int *g);
+  void open_log(unsigned int g, size_t valid);
+  void flush_wo();
+
+  static void encode(const record &r, std::string &out);
+  static void write_all(int fd, const std::string &buf);
+};
+
+// The extent server implements apply to rebuild its state from the log.
+class extent_log_apply {
+ public:
+  virtual void apply(const extent_log::record &) = 0;
+  virtual ~extent_log_apply() { }
+};
+
+#endif
@@ -15,7 +15,15 @@ class extent_protocol {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read_range,
+    write_range,
+    resize,
+    getall,
+    list,
+    getattr_multi,
+    reserve,
+    setattr
   };
 
   struct attr {
@@ -24,6 +32,12 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // Reply of getall: the content and attributes of the same version.
+  struct getallres {
+    std::string buf;
+    attr a;
+  };
 };
 
 inline unsigned int
@@ -52,4 +66,20 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::getallres &r)
+{
+  u >> r.buf;
+  u >> r.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::getallres &r)
+{
+  m << r.buf;
+  m << r.a;
+  return m;
+}
+
 #endif
@@ -0,0 +1,183 @@
+//
+// Move extents after extent servers are added or removed.
+//
+// Usage: extent_rebalance <old-servers> <new-servers>
+//
+// Both arguments are comma-separated lists as given to yfs_client. Every
+// extent on an old server that the new ring maps elsewhere is copied to
+// its new server and then removed from the old one. Copies that the old
+// ring does not map to the server holding them (e.g. the root directory
+// every extent server creates at startup) are left alone. Run it while no
+// yfs_client is using the extent servers.
+//
+// Extents are copied in pieces that stay well below the RPC layer's limit
+// on a message. Blocks that are all zeros are not written, so holes stay
+// holes on the new server, and the copy gets the attributes of the
+// original. An extent that cannot be copied is left on its old server.
+//
+
+#include "extent_protocol.h"
+#include "chash.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Extents are read in pieces of CHUNK bytes and written in runs of BLOCK
+// bytes that are not all zeros; BLOCK is the extent server's block size.
+static const unsigned int CHUNK = 1024 * 1024;
+static const unsigned int BLOCK = 64 * 1024;
+
+std::map<std::string, rpcc *> servers;
+
+rpcc *
+server(const std::string &node)
+{
+  if (servers.find(node) == servers.end()) {
+    sockaddr_in dst;
+    make_sockaddr(node.c_str(), &dst);
+
+    rpcc *cl = new rpcc(dst);
+    if (cl->bind() != 0) {
+      fprintf(stderr, "extent_rebalance: bind to %s failed\n", node.c_str());
+      exit(1);
+    }
+    servers[node] = cl;
+  }
+  return servers[node];
+}
+
+static bool
+zeros(const std::string &buf, unsigned int off, unsigned int len)
+{
+  for (unsigned int i = off; i < off + len; ++i) {
+    if (buf[i] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write [start, end) of @buf, read at offset @off of extent @id, to @dst.
+static extent_protocol::status
+write_run(extent_protocol::extentid_t id, const std::string &dst, unsigned int off,
+          const std::string &buf, unsigned int start, unsigned int end)
+{
+  int r;
+
+  if (start >= end) {
+    return extent_protocol::OK;
+  }
+  return server(dst)->call(extent_protocol::write_range, id, off + start,
+                           buf.substr(start, end - start), r);
+}
+
+// Copy extent @id from @src to @dst. The attributes are read first, since
+// reading the extent changes its atime.
+static extent_protocol::status
+copy(extent_protocol::extentid_t id, const std::string &src, const std::string &dst)
+{
+  extent_protocol::attr a;
+  int ret, r;
+
+  if ((ret = server(src)->call(extent_protocol::getattr, id, a)) != extent_protocol::OK) {
+    return ret;
+  }
+  if ((ret = server(dst)->call(extent_protocol::put, id, std::string(), r)) != extent_protocol::OK) {
+    return ret;
+  }
+  if ((ret = server(dst)->call(extent_protocol::resize, id, a.size, r)) != extent_protocol::OK) {
+    return ret;
+  }
+
+  for (unsigned int off = 0; off < a.size; off += CHUNK) {
+    unsigned int len = std::min(CHUNK, a.size - off);
+    std::string buf;
+
+    if ((ret = server(src)->call(extent_protocol::read_range, id, off, len, buf)) != extent_protocol::OK) {
+      return ret;
+    }
+    if (buf.size() != len) {
+      return extent_protocol::IOERR;
+    }
+
+    // Write each run of blocks that are not all zeros.
+    unsigned int start = 0;
+    for (unsigned int i = 0; i < len; i += BLOCK) {
+      unsigned int n = std::min(BLOCK, len - i);
+
+      if (zeros(buf, i, n)) {
+        if ((ret = write_run(id, dst, off, buf, start, i)) != extent_protocol::OK) {
+          return ret;
+        }
+        start = i + n;
+      }
+    }
+    if ((ret = write_run(id, dst, off, buf, start, len)) != extent_protocol::OK) {
+      return ret;
+    }
+  }
+
+  return server(dst)->call(extent_protocol::setattr, id, a, r);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <old-servers> <new-servers>\n", argv[0]);
+    exit(1);
+  }
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  std::vector<std::string> old_nodes = chash::split(argv[1]);
+  std::vector<std::string> new_nodes = chash::split(argv[2]);
+  chash old_ring(old_nodes);
+  chash new_ring(new_nodes);
+  int moved = 0, kept = 0, failed = 0;
+
+  for (unsigned int i = 0; i < old_nodes.size(); ++i) {
+    const std::string &src = old_nodes[i];
+    std::vector<extent_protocol::extentid_t> ids;
+    int r;
+
+    if (server(src)->call(extent_protocol::list, 0, ids) != extent_protocol::OK) {
+      fprintf(stderr, "extent_rebalance: cannot list the extents on %s\n", src.c_str());
+      failed += 1;
+      continue;
+    }
+
+    for (unsigned int j = 0; j < ids.size(); ++j) {
+      extent_protocol::extentid_t id = ids[j];
+
+      if (old_ring.lookup(id) != src) {
+        continue;
+      }
+
+      const std::string &dst = new_ring.lookup(id);
+      if (dst == src) {
+        kept += 1;
+        continue;
+      }
+
+      printf("moving extent %016llx from %s to %s\n", id, src.c_str(), dst.c_str());
+      if (copy(id, src, dst) != extent_protocol::OK ||
+          server(src)->call(extent_protocol::remove, id, r) != extent_protocol::OK) {
+        fprintf(stderr, "extent_rebalance: moving extent %016llx failed\n", id);
+        failed += 1;
+        continue;
+      }
+      moved += 1;
+    }
+  }
+
+  printf("extent_rebalance: moved %d extents, kept %d, failed %d\n",
+         moved, kept, failed);
+
+  return failed > 0 ? 1 : 0;
+}
@@ -1,37 +1,75 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include <algorithm>
 #include <fcntl.h>
 #include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-extent_server::extent_server()
+const unsigned int extent_server::BLOCK_SIZE;
+const size_t extent_server::CHECKPOINT_SIZE;
+const unsigned int extent_server::NSHARDS;
+
+extent_server::extent_server(std::string dir)
+  : wal(NULL), checkpointing(false)
 {
   pthread_mutex_init(&m, NULL);
+  for (unsigned int i = 0; i < NSHARDS; ++i) {
+    pthread_mutex_init(&shards[i].m, NULL);
+  }
+
+  if (!dir.empty()) {
+    size_t n = 0;
+
+    wal = new extent_log(dir);
+    wal->replay(this);
+    for (unsigned int i = 0; i < NSHARDS; ++i) {
+      n += shards[i].exts.size();
+    }
+    printf("extent_server: recovered %zu extents from %s\n", n, dir.c_str());
+  }
 
   // FUSE assumes that the inum for the root directory is 1.
-  int r;
-  put(1, "", r);
+  if (shard(1).exts.find(1) == shard(1).exts.end()) {
+    int r;
+    put(1, "", r);
+  }
 }
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
   printf("put request id=%lld, size=%ld\n", id, buf.size());
 
-  ScopedLock ml(&m);
   extent_t ext;
   unsigned int t = time_since_epoch();
+  unsigned long long lsn = 0;
 
   ext.attr.size = buf.size();
   ext.attr.atime = t;
   ext.attr.mtime = t;
   ext.attr.ctime = t;
-  ext.ext = std::move(buf);
+  fill_blocks(ext, buf);
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::PUT;
+      r.id = id;
+      r.data = std::move(buf);
+      r.attr = ext.attr;
+      lsn = wal->append(r);
+    }
+    sh.exts[id] = std::move(ext);
+  }
 
-  exts[id] = std::move(ext);
+  commit(lsn);
 
   return extent_protocol::OK;
 }
@@ -40,16 +78,25 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
   printf("get request id=%lld\n", id);
 
-  ScopedLock ml(&m);
-  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  std::vector<block_t> blocks;
+  unsigned int size;
 
-  it = exts.find(id);
-  if (it == exts.end()) {
-    return extent_protocol::IOERR;
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    it->second.attr.atime = time_since_epoch();
+    blocks = it->second.blocks;
+    size = it->second.attr.size;
   }
 
-  it->second.attr.atime = time_since_epoch();
-  buf = it->second.ext;
+  read_blocks(blocks, 0, size, buf);
 
   return extent_protocol::OK;
 }
@@ -58,11 +105,12 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 {
   printf("getattr request id=%lld\n", id);
 
-  ScopedLock ml(&m);
+  shard_t &sh = shard(id);
+  ScopedLock ml(&sh.m);
   std::map<extent_protocol::extentid_t, extent_t>::iterator it;
 
-  it = exts.find(id);
-  if (it == exts.end()) {
+  it = sh.exts.find(id);
+  if (it == sh.exts.end()) {
     return extent_protocol::IOERR;
   }
 
@@ -71,19 +119,526 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   return extent_protocol::OK;
 }
 
+// Same as get followed by getattr, but in one round trip and from the
+// same version of the extent.
+int extent_server::getall(extent_protocol::extentid_t id, extent_protocol::getallres &res)
+{
+  printf("getall request id=%lld\n", id);
+
+  std::vector<block_t> blocks;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    it->second.attr.atime = time_since_epoch();
+    blocks = it->second.blocks;
+    res.a = it->second.attr;
+  }
+
+  read_blocks(blocks, 0, res.a.size, res.buf);
+
+  return extent_protocol::OK;
+}
+
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
   printf("remove request id=%lld\n", id);
 
-  ScopedLock ml(&m);
+  unsigned long long lsn = 0;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) { // Silently OK if not found.
+      return extent_protocol::OK;
+    }
+
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::REMOVE;
+      r.id = id;
+      lsn = wal->append(r);
+    }
+    sh.exts.erase(it);
+  }
+
+  commit(lsn);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::read_range(extent_protocol::extentid_t id, unsigned int off,
+                              unsigned int len, std::string &buf)
+{
+  printf("read_range request id=%lld, off=%u, len=%u\n", id, off, len);
+
+  std::vector<block_t> blocks;
+  unsigned int size;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    it->second.attr.atime = time_since_epoch();
+    blocks = it->second.blocks;
+    size = it->second.attr.size;
+  }
+
+  if (off >= size) {
+    buf.clear();
+  } else {
+    read_blocks(blocks, off, std::min(len, size - off), buf);
+  }
+
+  return extent_protocol::OK;
+}
+
+// Bytes between the old end of the extent and @off are filled with '\0'.
+int extent_server::write_range(extent_protocol::extentid_t id, unsigned int off,
+                               std::string buf, int &)
+{
+  printf("write_range request id=%lld, off=%u, size=%ld\n", id, off, buf.size());
+
+  unsigned long long lsn = 0;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    extent_t &ext = it->second;
+    unsigned int t = time_since_epoch();
+
+    write_blocks(ext, off, buf);
+
+    ext.attr.mtime = t;
+    ext.attr.ctime = t;
+
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::WRITE;
+      r.id = id;
+      r.off = off;
+      r.data = std::move(buf);
+      r.attr = ext.attr;
+      lsn = wal->append(r);
+    }
+  }
+
+  commit(lsn);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::resize(extent_protocol::extentid_t id, unsigned int size, int &)
+{
+  printf("resize request id=%lld, size=%u\n", id, size);
+
+  unsigned long long lsn = 0;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    extent_t &ext = it->second;
+    unsigned int t = time_since_epoch();
+
+    resize_blocks(ext, size);
+
+    ext.attr.mtime = t;
+    ext.attr.ctime = t;
+
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::RESIZE;
+      r.id = id;
+      r.attr = ext.attr;
+      lsn = wal->append(r);
+    }
+  }
+
+  commit(lsn);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::setattr(extent_protocol::extentid_t id, extent_protocol::attr a, int &)
+{
+  printf("setattr request id=%lld\n", id);
+
+  unsigned long long lsn = 0;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    it = sh.exts.find(id);
+    if (it == sh.exts.end()) {
+      return extent_protocol::IOERR;
+    }
+
+    extent_t &ext = it->second;
+
+    ext.attr.atime = a.atime;
+    ext.attr.mtime = a.mtime;
+    ext.attr.ctime = a.ctime;
+
+    // Logged as a resize to the current size, which replays as just
+    // setting the attributes.
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::RESIZE;
+      r.id = id;
+      r.attr = ext.attr;
+      lsn = wal->append(r);
+    }
+  }
+
+  commit(lsn);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::getattr_multi(std::vector<extent_protocol::extentid_t> ids,
+                                 std::map<extent_protocol::extentid_t, extent_protocol::attr> &attrs)
+{
+  printf("getattr_multi request %zu ids\n", ids.size());
+
   std::map<extent_protocol::extentid_t, extent_t>::iterator it;
 
-  it = exts.find(id);
-  if (it == exts.end()) { // Silently OK if not found.
-    return extent_protocol::OK;
+  attrs.clear();
+  for (unsigned int i = 0; i < ids.size(); ++i) {
+    shard_t &sh = shard(ids[i]);
+    ScopedLock ml(&sh.m);
+
+    it = sh.exts.find(ids[i]);
+    if (it != sh.exts.end()) {
+      attrs[ids[i]] = it->second.attr;
+    }
   }
 
-  exts.erase(it);
+  return extent_protocol::OK;
+}
+
+int extent_server::reserve(extent_protocol::extentid_t id, unsigned int n,
+                           unsigned long long &first)
+{
+  printf("reserve request id=%lld n=%u\n", id, n);
+
+  unsigned long long lsn = 0;
+
+  {
+    shard_t &sh = shard(id);
+    ScopedLock ml(&sh.m);
+    std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+    first = 0;
+    it = sh.exts.find(id);
+    if (it != sh.exts.end()) {
+      std::string buf;
+      read_blocks(it->second.blocks, 0, it->second.attr.size, buf);
+      first = strtoull(buf.c_str(), NULL, 10);
+    }
+
+    std::string buf = std::to_string(first + n);
+    extent_t ext;
+    unsigned int t = time_since_epoch();
+
+    ext.attr.size = buf.size();
+    ext.attr.atime = t;
+    ext.attr.mtime = t;
+    ext.attr.ctime = t;
+    fill_blocks(ext, buf);
+
+    if (wal) {
+      extent_log::record r;
+      r.type = extent_log::PUT;
+      r.id = id;
+      r.data = std::move(buf);
+      r.attr = ext.attr;
+      lsn = wal->append(r);
+    }
+    sh.exts[id] = std::move(ext);
+  }
+
+  commit(lsn);
 
   return extent_protocol::OK;
 }
+
+// Return the ids of all extents, used to rebalance extents between servers.
+int extent_server::list(int, std::vector<extent_protocol::extentid_t> &ids)
+{
+  printf("list request\n");
+
+  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+
+  ids.clear();
+  for (unsigned int i = 0; i < NSHARDS; ++i) {
+    ScopedLock ml(&shards[i].m);
+    for (it = shards[i].exts.begin(); it != shards[i].exts.end(); ++it) {
+      ids.push_back(it->first);
+    }
+  }
+
+  return extent_protocol::OK;
+}
+
+// Rebuild the extents from a record of the checkpoint or the log.
+void
+extent_server::apply(const extent_log::record &r)
+{
+  switch (r.type) {
+    case extent_log::PUT: {
+      // A checkpoint puts the extent as a hole of its size and then
+      // writes the blocks that are not holes.
+      extent_t &ext = shard(r.id).exts[r.id];
+      ext.blocks.clear();
+      fill_blocks(ext, r.data);
+      ext.attr.size = r.data.size();
+      resize_blocks(ext, r.attr.size);
+      ext.attr = r.attr;
+      break;
+    }
+
+    case extent_log::WRITE: {
+      extent_t &ext = shard(r.id).exts[r.id];
+      write_blocks(ext, r.off, r.data);
+      ext.attr = r.attr;
+      break;
+    }
+
+    case extent_log::RESIZE: {
+      extent_t &ext = shard(r.id).exts[r.id];
+      resize_blocks(ext, r.attr.size);
+      ext.attr = r.attr;
+      break;
+    }
+
+    case extent_log::REMOVE: {
+      shard(r.id).exts.erase(r.id);
+      break;
+    }
+
+    default:
+      VERIFY(0);
+  }
+}
+
+// Wait until the update logged as @lsn is durable before replying, and
+// compact the log once it grows too long. Must not hold m.
+void
+extent_server::commit(unsigned long long lsn)
+{
+  if (wal == NULL) {
+    return;
+  }
+
+  wal->sync(lsn);
+
+  if (wal->size() >= CHECKPOINT_SIZE) {
+    checkpoint();
+  }
+}
+
+// Write all extents into a new checkpoint. Only the block lists are
+// copied with every shard locked; the data is written out from that
+// snapshot while requests keep going into the next log generation.
+void
+extent_server::checkpoint()
+{
+  std::map<extent_protocol::extentid_t, extent_t> snapshot;
+  std::map<extent_protocol::extentid_t, extent_t>::iterator it;
+  unsigned int gen;
+
+  {
+    ScopedLock ml(&m);
+
+    if (checkpointing) {
+      return;
+    }
+    checkpointing = true;
+  }
+
+  for (unsigned int i = 0; i < NSHARDS; ++i) {
+    VERIFY(pthread_mutex_lock(&shards[i].m) == 0);
+  }
+  for (unsigned int i = 0; i < NSHARDS; ++i) {
+    snapshot.insert(shards[i].exts.begin(), shards[i].exts.end());
+  }
+  gen = wal->rotate();
+  for (unsigned int i = 0; i < NSHARDS; ++i) {
+    VERIFY(pthread_mutex_unlock(&shards[i].m) == 0);
+  }
+
+  wal->checkpoint_begin(gen);
+  for (it = snapshot.begin(); it != snapshot.end(); ++it) {
+    const std::vector<block_t> &blocks = it->second.blocks;
+    extent_log::record r;
+
+    r.type = extent_log::PUT;
+    r.id = it->first;
+    r.attr = it->second.attr;
+    wal->checkpoint_add(r);
+
+    r.type = extent_log::WRITE;
+    for (unsigned int i = 0; i < blocks.size(); ++i) {
+      if (blocks[i]) {
+        r.off = i * BLOCK_SIZE;
+        r.data = *blocks[i];
+        wal->checkpoint_add(r);
+      }
+    }
+  }
+  wal->checkpoint_end();
+
+  ScopedLock ml(&m);
+  checkpointing = false;
+}
+
+extent_server::shard_t &
+extent_server::shard(extent_protocol::extentid_t id)
+{
+  // Inums are handed out in sequential ranges, mix the bits so that they
+  // spread over the shards.
+  return shards[((id * 0x9e3779b97f4a7c15ULL) >> 32) % NSHARDS];
+}
+
+// Blocks of @buf that are all zeros are stored as holes.
+void
+extent_server::fill_blocks(extent_t &ext, const std::string &buf)
+{
+  for (unsigned int off = 0; off < buf.size(); off += BLOCK_SIZE) {
+    unsigned int end = std::min((unsigned int) buf.size(), off + BLOCK_SIZE);
+    unsigned int i = off;
+
+    while (i < end && buf[i] == '\0') {
+      i++;
+    }
+    if (i == end) {
+      ext.blocks.push_back(block_t());
+    } else {
+      ext.blocks.push_back(std::make_shared<std::string>(buf, off, BLOCK_SIZE));
+    }
+  }
+}
+
+// Make block @i private to this extent before it is modified, filling in
+// a hole. Block sizes follow from ext.attr.size.
+std::string &
+extent_server::writable(extent_t &ext, unsigned int i)
+{
+  block_t &b = ext.blocks[i];
+
+  if (!b) {
+    unsigned int len = BLOCK_SIZE;
+    if (i + 1 == ext.blocks.size()) {
+      len = ext.attr.size - i * BLOCK_SIZE;
+    }
+    b = std::make_shared<std::string>(len, '\0');
+  } else if (b.use_count() > 1) {
+    b = std::make_shared<std::string>(*b);
+  }
+  return *b;
+}
+
+// Copy [off, off + len) out of @blocks; the range must be within the extent.
+void
+extent_server::read_blocks(const std::vector<block_t> &blocks, unsigned int off,
+                           unsigned int len, std::string &buf)
+{
+  unsigned int end = off + len;
+
+  buf.clear();
+  buf.reserve(len);
+
+  while (off < end) {
+    unsigned int boff = off % BLOCK_SIZE;
+    unsigned int n = std::min(BLOCK_SIZE - boff, end - off);
+    const block_t &b = blocks[off / BLOCK_SIZE];
+
+    if (b) {
+      buf.append(*b, boff, n);
+    } else {
+      buf.append(n, '\0');
+    }
+    off += n;
+  }
+}
+
+void
+extent_server::write_blocks(extent_t &ext, unsigned int off, const std::string &buf)
+{
+  unsigned int pos = off;
+  unsigned int end = off + buf.size();
+
+  if (ext.attr.size < end) {
+    resize_blocks(ext, end);
+  }
+
+  while (pos < end) {
+    unsigned int boff = pos % BLOCK_SIZE;
+    unsigned int n = std::min(BLOCK_SIZE - boff, end - pos);
+
+    writable(ext, pos / BLOCK_SIZE).replace(boff, n, buf, pos - off, n);
+    pos += n;
+  }
+}
+
+// Bytes beyond the old end of the extent read as '\0'. Only the old and
+// the new last block are touched; the blocks in between are holes.
+void
+extent_server::resize_blocks(extent_t &ext, unsigned int size)
+{
+  unsigned int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (size == ext.attr.size) {
+    return;
+  }
+
+  if (size < ext.attr.size) {
+    ext.blocks.resize(nblocks);
+  } else if (!ext.blocks.empty() && ext.blocks.back() &&
+             ext.blocks.back()->size() < BLOCK_SIZE) {
+    unsigned int last = ext.blocks.size() - 1;
+    writable(ext, last).resize(std::min(BLOCK_SIZE, size - last * BLOCK_SIZE));
+  }
+
+  ext.blocks.resize(nblocks);
+  ext.attr.size = size;
+
+  if (nblocks > 0 && ext.blocks.back()) {
+    unsigned int tail = size - (nblocks - 1) * BLOCK_SIZE;
+    if (ext.blocks.back()->size() != tail) {
+      writable(ext, nblocks - 1).resize(tail);
+    }
+  }
+}
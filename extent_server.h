@@ -5,26 +5,93 @@
 
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 #include "extent_protocol.h"
+#include "extent_log.h"
 
-class extent_server {
+class extent_server : public extent_log_apply {
 
  public:
-  extent_server();
+  // Keep the extents in memory only if @dir is empty; otherwise they are
+  // recovered from and logged to the data directory @dir.
+  extent_server(std::string dir = "");
 
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+  int getall(extent_protocol::extentid_t id, extent_protocol::getallres &);
+  // Attributes of every extent in @ids that exists, in one round trip.
+  int getattr_multi(std::vector<extent_protocol::extentid_t> ids,
+                    std::map<extent_protocol::extentid_t, extent_protocol::attr> &);
   int remove(extent_protocol::extentid_t id, int &);
 
+  int read_range(extent_protocol::extentid_t id, unsigned int off,
+                 unsigned int len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned int off,
+                  std::string, int &);
+  int resize(extent_protocol::extentid_t id, unsigned int size, int &);
+  // Set the times of extent @id to those in @a; the size is unchanged.
+  // Used to keep the attributes of an extent that is moved to another
+  // server.
+  int setattr(extent_protocol::extentid_t id, extent_protocol::attr a, int &);
+
+  int list(int, std::vector<extent_protocol::extentid_t> &);
+
+  // Treat extent @id as a counter, starting at 0 if it does not exist:
+  // add @n to it and return the old value in @first, so that each caller
+  // owns a distinct range [first, first + n). The update is durable
+  // before the reply is sent.
+  int reserve(extent_protocol::extentid_t id, unsigned int n,
+              unsigned long long &first);
+
  private:
+  // Extents are stored as a list of fixed-size blocks, so that writes and
+  // appends only touch the affected blocks. Blocks are refcounted and
+  // copied on write, which lets readers take a snapshot of an extent
+  // and copy the data out without holding the mutex. A NULL block is a
+  // hole that reads as zeros, so growing an extent or writing far beyond
+  // its end stores nothing for the bytes in between.
+  static const unsigned int BLOCK_SIZE = 64 * 1024;
+
+  // Write a checkpoint once the log grows beyond this size.
+  static const size_t CHECKPOINT_SIZE = 64 * 1024 * 1024;
+
+  typedef std::shared_ptr<std::string> block_t;
+
   struct extent_t {
-    std::string ext;
+    std::vector<block_t> blocks; // every block but the last is full or NULL
     extent_protocol::attr attr;
   };
 
-  pthread_mutex_t m;
-  std::map<extent_protocol::extentid_t, extent_t> exts;
+  static void fill_blocks(extent_t &, const std::string &);
+  static std::string &writable(extent_t &, unsigned int i);
+  static void read_blocks(const std::vector<block_t> &, unsigned int off,
+                          unsigned int len, std::string &);
+  static void write_blocks(extent_t &, unsigned int off, const std::string &);
+  static void resize_blocks(extent_t &, unsigned int size);
+
+  // The extents are partitioned by id into shards with a mutex each, so
+  // requests on different extents seldom contend.
+  static const unsigned int NSHARDS = 16;
+
+  struct shard_t {
+    pthread_mutex_t m;
+    std::map<extent_protocol::extentid_t, extent_t> exts;
+  };
+
+  shard_t &shard(extent_protocol::extentid_t id);
+
+  void apply(const extent_log::record &);
+  void commit(unsigned long long lsn);
+  void checkpoint();
+
+  extent_log *wal;     // NULL if the extents are kept in memory only
+
+  pthread_mutex_t m;   // protects checkpointing
+  bool checkpointing;
+
+  shard_t shards[NSHARDS];
 };
 
 #endif
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "extent_server.h"
 
 // Main loop of extent server
@@ -11,9 +12,13 @@ int
 main(int argc, char *argv[])
 {
   int count = 0;
+  std::string dir;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // Without a data directory, the extents are kept in memory only.
+  if (argc == 4 && strcmp(argv[2], "-d") == 0) {
+    dir = argv[3];
+  } else if (argc != 2) {
+    fprintf(stderr, "Usage: %s port [-d datadir]\n", argv[0]);
     exit(1);
   }
 
@@ -25,12 +30,20 @@ main(int argc, char *argv[])
   }
 
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(dir);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
+  server.reg(extent_protocol::getall, &ls, &extent_server::getall);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::resize, &ls, &extent_server::resize);
+  server.reg(extent_protocol::list, &ls, &extent_server::list);
+  server.reg(extent_protocol::getattr_multi, &ls, &extent_server::getattr_multi);
+  server.reg(extent_protocol::reserve, &ls, &extent_server::reserve);
+  server.reg(extent_protocol::setattr, &ls, &extent_server::setattr);
 
   while (true) {
     sleep(1000);
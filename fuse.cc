@@ -15,12 +15,172 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <map>
+#include <set>
+#include <string>
 #include "lang/verify.h"
+#include "rpc/fifo.h"
+#include "rpc/slock.h"
 #include "yfs_client.h"
 
 int myid;
 yfs_client *yfs;
 
+// Seconds the kernel may cache attributes and directory entries, 0 to
+// disable caching. Entries handed out are invalidated as soon as this
+// client gives up the lock on the inode, so other clients never see them
+// go stale.
+double cache_timeout = 10.0;
+
+//
+// Tells the kernel to drop the attributes and dentries it cached for an
+// inode once yfs_client gives up the inode's lock. invalidate() is called
+// from the lock client while it holds its mutex, and the kernel may be
+// waiting in a FUSE request on the same directory for that lock, so the
+// notifications are sent by a separate thread.
+//
+class fuseserver_invalidator : public yfs_invalidate_user {
+ public:
+  fuseserver_invalidator();
+
+  void start(struct fuse_chan *ch);
+
+  // Remember that the kernel caches @name in directory @parent.
+  void add_entry(yfs_client::inum parent, const std::string &name);
+  void remove_entry(yfs_client::inum parent, const std::string &name);
+
+  // A reply built while a lock was given up may reach the kernel after
+  // the notification. Callers take the number of invalidations so far
+  // before handling a request, and after replying call sent() or
+  // sent_entry(), which invalidate again if any lock was given up since.
+  unsigned long long epoch();
+  void sent(unsigned long long epoch, yfs_client::inum inum);
+  void sent_entry(unsigned long long epoch, yfs_client::inum parent,
+                  const std::string &name, yfs_client::inum inum);
+
+  virtual void invalidate(unsigned long long inum);
+
+  void notifier();
+
+ private:
+  struct fuse_chan *ch;
+  fifo<yfs_client::inum> q;
+
+  pthread_mutex_t m;  // protects entries and invalidations
+  std::map<yfs_client::inum, std::set<std::string> > entries;
+  unsigned long long invalidations;
+};
+
+fuseserver_invalidator *inval;
+
+static void *
+notifierthread(void *x)
+{
+  fuseserver_invalidator *iv = (fuseserver_invalidator *) x;
+  iv->notifier();
+  return 0;
+}
+
+fuseserver_invalidator::fuseserver_invalidator()
+  : ch(NULL), invalidations(0)
+{
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+}
+
+void
+fuseserver_invalidator::start(struct fuse_chan *c)
+{
+  pthread_t th;
+
+  ch = c;
+  VERIFY(pthread_create(&th, NULL, &notifierthread, (void *) this) == 0);
+}
+
+void
+fuseserver_invalidator::add_entry(yfs_client::inum parent,
+                                  const std::string &name)
+{
+  ScopedLock ml(&m);
+  entries[parent].insert(name);
+}
+
+void
+fuseserver_invalidator::remove_entry(yfs_client::inum parent,
+                                     const std::string &name)
+{
+  ScopedLock ml(&m);
+  std::map<yfs_client::inum, std::set<std::string> >::iterator it =
+    entries.find(parent);
+  if (it != entries.end()) {
+    it->second.erase(name);
+  }
+}
+
+unsigned long long
+fuseserver_invalidator::epoch()
+{
+  ScopedLock ml(&m);
+  return invalidations;
+}
+
+void
+fuseserver_invalidator::sent(unsigned long long e, yfs_client::inum inum)
+{
+  if (epoch() != e) {
+    invalidate(inum);
+  }
+}
+
+void
+fuseserver_invalidator::sent_entry(unsigned long long e,
+                                   yfs_client::inum parent,
+                                   const std::string &name,
+                                   yfs_client::inum inum)
+{
+  if (epoch() != e) {
+    add_entry(parent, name);
+    invalidate(parent);
+    invalidate(inum);
+  }
+}
+
+void
+fuseserver_invalidator::invalidate(unsigned long long inum)
+{
+  {
+    ScopedLock ml(&m);
+    invalidations += 1;
+  }
+  q.enq(inum);
+}
+
+void
+fuseserver_invalidator::notifier()
+{
+  while (true) {
+    yfs_client::inum inum;
+    std::set<std::string> names;
+
+    q.deq(&inum);
+    {
+      ScopedLock ml(&m);
+      std::map<yfs_client::inum, std::set<std::string> >::iterator it =
+        entries.find(inum);
+      if (it != entries.end()) {
+        names.swap(it->second);
+        entries.erase(it);
+      }
+    }
+
+    // ENOENT only means the kernel no longer caches the inode or name.
+    fuse_lowlevel_notify_inval_inode(ch, inum, 0, 0);
+    for (std::set<std::string>::iterator it = names.begin();
+         it != names.end(); ++it) {
+      fuse_lowlevel_notify_inval_entry(ch, inum, it->c_str(), it->size());
+    }
+  }
+}
+
 int id() {
   return myid;
 }
@@ -95,13 +255,15 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
   struct stat st;
   yfs_client::inum inum = ino; // req->in.h.nodeid;
   yfs_client::status ret;
+  unsigned long long epoch = inval->epoch();
 
   ret = getattr(inum, st);
   if (ret != yfs_client::OK) {
     fuse_reply_err(req, ENOENT);
     return;
   }
-  fuse_reply_attr(req, &st, 0);
+  fuse_reply_attr(req, &st, cache_timeout);
+  inval->sent(epoch, inum);
 }
 
 //
@@ -130,8 +292,12 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 
   printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
 
-  if (yfs->setattr(ino, attr->st_size) != yfs_client::OK) {
-    goto bad;
+  unsigned long long epoch = inval->epoch();
+  yfs_client::status ret;
+
+  if ((ret = yfs->setattr(ino, attr->st_size)) != yfs_client::OK) {
+    fuse_reply_err(req, ret == yfs_client::FBIG ? EFBIG : ENOENT);
+    return;
   }
 
   struct stat st;
@@ -139,7 +305,8 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
   if (getattr(ino, st) != yfs_client::OK) {
     goto bad;
   }
-  fuse_reply_attr(req, &st, 0);
+  fuse_reply_attr(req, &st, cache_timeout);
+  inval->sent(epoch, ino);
 
   return;
 
@@ -163,7 +330,7 @@ void
 fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                 off_t off, struct fuse_file_info *fi)
 {
-  std::string buf;
+  extent_buf buf;
 
   if (yfs->read(ino, size, off, buf) != yfs_client::OK) {
     fuse_reply_err(req, ENOENT);
@@ -192,8 +359,10 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
                  const char *buf, size_t size, off_t off,
                  struct fuse_file_info *fi)
 {
-  if (yfs->write(ino, buf, size, off) != yfs_client::OK) {
-    fuse_reply_err(req, ENOENT);
+  yfs_client::status ret;
+
+  if ((ret = yfs->write(ino, buf, size, off)) != yfs_client::OK) {
+    fuse_reply_err(req, ret == yfs_client::FBIG ? EFBIG : ENOENT);
   } else {
     fuse_reply_write(req, size);
   }
@@ -223,10 +392,9 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
 {
   printf("fuseserver_createhelper %08lx %s\n", parent, name);
 
-  // In yfs, timeouts are always set to 0.0, and generations are always set
-  // to 0.
-  e->attr_timeout = 0.0;
-  e->entry_timeout = 0.0;
+  // Generations are always set to 0.
+  e->attr_timeout = cache_timeout;
+  e->entry_timeout = cache_timeout;
   e->generation = 0;
 
   yfs_client::inum child = 0;
@@ -255,8 +423,11 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 {
   struct fuse_entry_param e;
   yfs_client::status ret;
+  unsigned long long epoch = inval->epoch();
   if ((ret = fuseserver_createhelper(parent, name, mode, &e)) == yfs_client::OK) {
+    inval->add_entry(parent, name);
     fuse_reply_create(req, &e, fi);
+    inval->sent_entry(epoch, parent, name, e.ino);
   } else {
     if (ret == yfs_client::EXIST) {
       fuse_reply_err(req, EEXIST);
@@ -272,8 +443,11 @@ fuseserver_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 {
   struct fuse_entry_param e;
   yfs_client::status ret;
+  unsigned long long epoch = inval->epoch();
   if ((ret = fuseserver_createhelper(parent, name, mode, &e)) == yfs_client::OK) {
+    inval->add_entry(parent, name);
     fuse_reply_entry(req, &e);
+    inval->sent_entry(epoch, parent, name, e.ino);
   } else {
     if (ret == yfs_client::EXIST) {
       fuse_reply_err(req, EEXIST);
@@ -293,15 +467,15 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
   struct fuse_entry_param e;
 
-  // In yfs, timeouts are always set to 0.0, and generations are always set
-  // to 0.
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  // Generations are always set to 0.
+  e.attr_timeout = cache_timeout;
+  e.entry_timeout = cache_timeout;
   e.generation = 0;
 
   yfs_client::inum child = 0;
   struct stat st;
   yfs_client::status status;
+  unsigned long long epoch = inval->epoch();
 
   status = yfs->lookup(parent, name, child);
   if (status != yfs_client::OK) {
@@ -316,7 +490,9 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
   e.ino = child;
   e.attr = st;
 
+  inval->add_entry(parent, name);
   fuse_reply_entry(req, &e);
+  inval->sent_entry(epoch, parent, name, child);
   return;
 
  bad:
@@ -329,15 +505,12 @@ struct dirbuf {
   size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+void dirbuf_add(struct dirbuf *b, const char *name, const struct stat *stbuf)
 {
-  struct stat stbuf;
   size_t oldsize = b->size;
   b->size += fuse_dirent_size(strlen(name));
   b->p = (char *) realloc(b->p, b->size);
-  memset(&stbuf, 0, sizeof(stbuf));
-  stbuf.st_ino = ino;
-  fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
+  fuse_add_dirent(b->p + oldsize, name, stbuf, b->size);
 }
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
@@ -358,7 +531,10 @@ int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
 // You can ignore @size and @off (except that you must pass
 // them to reply_buf_limited).
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Call dirbuf_add(&b, name, &st) for each entry in the directory. With
+// FUSE_USE_VERSION 25 the kernel only looks at st_ino and the type bits
+// of st_mode, so only the names are read; yfs_client::readdirplus has the
+// attributes for a READDIRPLUS once the client uses the libfuse 3 API.
 //
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -387,7 +563,12 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 
   for (std::vector<yfs_client::dirent>::iterator it = ents.begin();
         it != ents.end(); ++it) {
-    dirbuf_add(&b, it->name.c_str(), it->inum);
+    struct stat st;
+
+    bzero(&st, sizeof(st));
+    st.st_ino = it->inum;
+    st.st_mode = yfs->isfile(it->inum) ? S_IFREG : S_IFDIR;
+    dirbuf_add(&b, it->name.c_str(), &st);
   }
 
   reply_buf_limited(req, b.p, b.size, off, size);
@@ -417,15 +598,15 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 {
   struct fuse_entry_param e;
 
-  // In yfs, timeouts are always set to 0.0, and generations are always set
-  // to 0.
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  // Generations are always set to 0.
+  e.attr_timeout = cache_timeout;
+  e.entry_timeout = cache_timeout;
   e.generation = 0;
 
   yfs_client::inum child = 0;
   struct stat st;
   yfs_client::status status;
+  unsigned long long epoch = inval->epoch();
 
   status = yfs->create(parent, false /* is_file */, name, child);
   if (status != yfs_client::OK) {
@@ -440,7 +621,9 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
   e.ino = child;
   e.attr = st;
 
+  inval->add_entry(parent, name);
   fuse_reply_entry(req, &e);
+  inval->sent_entry(epoch, parent, name, child);
   return;
 
  bad:
@@ -462,6 +645,8 @@ void
 fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
   if (yfs->unlink(parent, name) == yfs_client::OK) {
+    // The kernel drops the dentry itself on a successful unlink.
+    inval->remove_entry(parent, name);
     fuse_reply_err(req, 0);
   } else {
     fuse_reply_err(req, ENOENT);
@@ -485,6 +670,60 @@ fuseserver_statfs(fuse_req_t req)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+//
+// Like fuse_session_loop_mt, but with a fixed number of workers. Each
+// worker reads a request from the channel and handles it, so requests
+// on different inodes run in parallel; yfs_client serializes requests
+// on the same inode with the inode's lock.
+//
+void *
+fuseserver_worker(void *x)
+{
+  struct fuse_session *se = (struct fuse_session *) x;
+  struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+  size_t bufsize = fuse_chan_bufsize(ch);
+  char *buf = (char *) malloc(bufsize);
+
+  VERIFY(buf != NULL);
+
+  while (!fuse_session_exited(se)) {
+    struct fuse_chan *tmpch = ch;
+    int res = fuse_chan_recv(&tmpch, buf, bufsize);
+
+    if (res == -EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      break;  // unmounted or failed
+    }
+    fuse_session_process(se, buf, res, tmpch);
+  }
+
+  free(buf);
+  fuse_session_exit(se);
+  return 0;
+}
+
+int
+fuseserver_loop(struct fuse_session *se, int nthreads)
+{
+  if (nthreads <= 1) {
+    return fuse_session_loop(se);
+  }
+
+  pthread_t th[nthreads];
+
+  for (int i = 0; i < nthreads; i++) {
+    VERIFY(pthread_create(&th[i], NULL, fuseserver_worker, (void *) se) == 0);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(th[i], NULL);
+  }
+
+  fuse_session_reset(se);
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -495,7 +734,7 @@ main(int argc, char *argv[])
   setvbuf(stdout, NULL, _IONBF, 0);
 
   if (argc != 4) {
-    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
+    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server>[,<port-extent-server>...] <port-lock-server>\n");
     exit(1);
   }
   mountpoint = argv[1];
@@ -504,7 +743,35 @@ main(int argc, char *argv[])
 
   myid = random();
 
-  yfs = new yfs_client(argv[2], argv[3]);
+  // The extent cache budget in MB can be set with YFS_CACHE_MB. Dirty
+  // extents are written back in the background after YFS_WRITEBACK_SEC
+  // seconds or once more than YFS_DIRTY_MB are dirty.
+  size_t cache_budget = extent_client::DEFAULT_BUDGET;
+  unsigned int writeback_age = extent_client::DEFAULT_WRITEBACK_AGE;
+  size_t dirty_limit = extent_client::DEFAULT_DIRTY_LIMIT;
+  int nthreads = 8;
+
+  if (getenv("YFS_CACHE_MB") != NULL) {
+    cache_budget = (size_t) atoi(getenv("YFS_CACHE_MB")) * 1024 * 1024;
+  }
+  if (getenv("YFS_WRITEBACK_SEC") != NULL) {
+    writeback_age = atoi(getenv("YFS_WRITEBACK_SEC"));
+  }
+  if (getenv("YFS_DIRTY_MB") != NULL) {
+    dirty_limit = (size_t) atoi(getenv("YFS_DIRTY_MB")) * 1024 * 1024;
+  }
+  // Number of threads serving FUSE requests, 1 for the old serial loop.
+  if (getenv("YFS_FUSE_THREADS") != NULL) {
+    nthreads = atoi(getenv("YFS_FUSE_THREADS"));
+  }
+  // Seconds the kernel may cache attributes and names, 0 to disable.
+  if (getenv("YFS_CACHE_TIMEOUT") != NULL) {
+    cache_timeout = atof(getenv("YFS_CACHE_TIMEOUT"));
+  }
+
+  inval = new fuseserver_invalidator();
+  yfs = new yfs_client(argv[2], argv[3], cache_budget, writeback_age,
+                       dirty_limit, inval);
 
   fuseserver_oper.getattr    = fuseserver_getattr;
   fuseserver_oper.statfs     = fuseserver_statfs;
@@ -567,12 +834,18 @@ main(int argc, char *argv[])
   }
 
   fuse_session_add_chan(se, ch);
-  // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-  err = fuse_session_loop(se);
+  inval->start(ch);
+  err = fuseserver_loop(se, nthreads);
 
   fuse_session_destroy(se);
   close(fd);
   fuse_unmount(mountpoint);
 
+  extent_client::cache_stats st = yfs->cache_stats();
+  printf("extent cache: %llu hits, %llu misses, %llu evictions, "
+         "%llu write-backs, %zu bytes in %zu entries\n",
+         st.hits, st.misses, st.evictions, st.writebacks, st.bytes,
+         st.entries);
+
   return err ? 1 : 0;
 }
@@ -0,0 +1,151 @@
+//
+// Lock client and server scaling benchmark
+//
+// Runs acquire/release pairs on randomly chosen locks from 1, 2, 4, ...
+// threads and prints the throughput for each thread count.
+//
+// By default the threads share one caching lock client. Once a lock is
+// cached, acquire and release never leave the client, so this mostly
+// measures contention on the client's lock table.
+//
+// With "server", every thread has a client of its own and gives each lock
+// back as it releases it, so every acquire and release is an RPC to the
+// lock server and the threads contend on the server's lock table. Each
+// thread picks from its own range of lock ids, so no thread waits for
+// another's lock. Built with LAB < 7 this drives the caching lock_server;
+// with the RSM, its handlers run one at a time anyway.
+//
+// Run it against a running lock_server.
+//
+
+#include "lock_protocol.h"
+#include "rpc.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include "lang/verify.h"
+#ifdef RSM
+#include "lock_client_cache_rsm.h"
+typedef lock_client_cache_rsm lock_client_t;
+#else
+#include "lock_client_cache.h"
+typedef lock_client_cache lock_client_t;
+#endif
+
+std::string dst;
+lock_client_t *lc;
+int nlocks = 1024;
+int seconds = 3;
+bool server;
+volatile bool done;
+
+struct worker_t {
+  unsigned int seed;
+  lock_client_t *lc;
+  lock_protocol::lockid_t first;  // locks are first .. first + nlocks - 1
+  unsigned long long ops;
+};
+
+void *
+worker(void *x)
+{
+  worker_t *w = (worker_t *) x;
+
+  for (w->ops = 0; !done; w->ops++) {
+    lock_protocol::lockid_t lid = w->first + rand_r(&w->seed) % nlocks;
+
+    VERIFY(w->lc->acquire(lid) == lock_protocol::OK);
+    VERIFY(w->lc->release(lid, server /* flush */) == lock_protocol::OK);
+  }
+
+  return 0;
+}
+
+double
+run(int nt, lock_client_t **clients)
+{
+  pthread_t th[nt];
+  worker_t w[nt];
+  unsigned long long ops = 0;
+
+  done = false;
+  for (int i = 0; i < nt; i++) {
+    w[i].seed = i + 1;
+    w[i].lc = server ? clients[i] : lc;
+    w[i].first = server ? 1 + i * nlocks : 1;
+    VERIFY(pthread_create(&th[i], NULL, worker, (void *) &w[i]) == 0);
+  }
+
+  sleep(seconds);
+  done = true;
+
+  for (int i = 0; i < nt; i++) {
+    pthread_join(th[i], NULL);
+    ops += w[i].ops;
+  }
+
+  return (double) ops / seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int max_nt = 16;
+
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr, "Usage: %s [host:]port [max-threads] [locks] [server]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  dst = argv[1];
+  if (argc > 2) {
+    max_nt = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    nlocks = atoi(argv[3]);
+  }
+  if (argc > 4) {
+    server = std::string(argv[4]) == "server";
+  }
+
+  // The client logs every RPC; keep that out of the measurement.
+  VERIFY(freopen("/dev/null", "w", stdout) != NULL);
+
+  lock_client_t *clients[max_nt];
+  if (server) {
+    for (int i = 0; i < max_nt; i++) {
+      clients[i] = new lock_client_t(dst);
+    }
+  } else {
+    lc = new lock_client_t(dst);
+
+    // Take every lock once so that the runs below find them cached.
+    for (int i = 1; i <= nlocks; i++) {
+      VERIFY(lc->acquire(i) == lock_protocol::OK);
+      VERIFY(lc->release(i) == lock_protocol::OK);
+    }
+  }
+
+  fprintf(stderr, "%d locks%s, %d seconds per run\n", nlocks,
+          server ? " per thread, all through the server" : "", seconds);
+  fprintf(stderr, "threads      ops/s  speedup\n");
+
+  double base = 0;
+  for (int nt = 1; nt <= max_nt; nt *= 2) {
+    double tput = run(nt, clients);
+    if (nt == 1) {
+      base = tput;
+    }
+    fprintf(stderr, "%7d %10.0f %8.2f\n", nt, tput, tput / base);
+  }
+
+  // Give the cached locks back, or the server would try to revoke them
+  // from a client that is gone.
+  for (int i = 1; !server && i <= nlocks; i++) {
+    VERIFY(lc->release_early(i) == lock_protocol::OK);
+  }
+
+  return 0;
+}
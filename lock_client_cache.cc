@@ -5,6 +5,7 @@
 #include "rpc.h"
 #include <iostream>
 #include <stdio.h>
+#include <algorithm>
 #include "tprintf.h"
 
 lock_client_cache::lock_client_cache(
@@ -17,7 +18,9 @@ lock_client_cache::lock_client_cache(
 
   id = std::string("127.0.0.1:") + std::to_string(rlsrpc->port());
 
-  pthread_mutex_init(&m, NULL);
+  for (unsigned int i = 0; i < NSTRIPES; ++i) {
+    pthread_mutex_init(&stripes[i].m, NULL);
+  }
 }
 
 int
@@ -28,10 +31,18 @@ lock_client_cache::stat(lock_protocol::lockid_t lid)
   return r;
 }
 
+lock_client_cache::stripe_t &
+lock_client_cache::stripe(lock_protocol::lockid_t lid)
+{
+  // Inums are handed out in sequential ranges, mix the bits so that they
+  // spread over the stripes.
+  return stripes[((lid * 0x9e3779b97f4a7c15ULL) >> 32) % NSTRIPES];
+}
+
 lock_protocol::status
 lock_client_cache::acquire_impl(
-    lock_protocol::lockid_t lid,
-    std::map<lock_protocol::lockid_t, lock_t>::iterator it)
+    lock_protocol::lockid_t lid, stripe_t &s,
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it, bool shared)
 {
   VERIFY(it->second.status == lock_status::none);
 
@@ -41,22 +52,24 @@ lock_client_cache::acquire_impl(
   int r = 0;
 
   while (true) {
-    pthread_mutex_unlock(&m);
-    ret = cl->call(lock_protocol::acquire, lid, id, r);
-    pthread_mutex_lock(&m);
+    pthread_mutex_unlock(&s.m);
+    ret = cl->call((shared ? lock_protocol::acquire_shared
+                                       : lock_protocol::acquire), lid, id, r);
+    pthread_mutex_lock(&s.m);
 
     if (ret == lock_protocol::OK || ret != lock_protocol::RETRY) {
       break;
     }
 
     while (!it->second.should_retry) {
-      pthread_cond_wait(&it->second.retry_c, &m);
+      pthread_cond_wait(&it->second.retry_c, &s.m);
     }
     it->second.should_retry = false;
   }
 
   if (ret == lock_protocol::OK) {
     it->second.status = lock_status::free;
+    it->second.shared = shared;
     if (r) { // other clients are also waiting for the lock.
       it->second.revoked = true;
     }
@@ -69,7 +82,7 @@ lock_client_cache::acquire_impl(
 
 lock_protocol::status
 lock_client_cache::release_impl(
-    lock_protocol::lockid_t lid,
+    lock_protocol::lockid_t lid, stripe_t &s,
     std::map<lock_protocol::lockid_t, lock_t>::iterator it)
 {
   lock_status status = it->second.status;
@@ -85,9 +98,9 @@ lock_client_cache::release_impl(
   lock_protocol::status ret;
   int r;
 
-  pthread_mutex_unlock(&m);
+  pthread_mutex_unlock(&s.m);
   ret = cl->call(lock_protocol::release, lid, id, r);
-  pthread_mutex_lock(&m);
+  pthread_mutex_lock(&s.m);
 
   if (ret == lock_protocol::OK) {
     it->second.owner = 0;
@@ -103,20 +116,26 @@ lock_client_cache::release_impl(
 lock_protocol::status
 lock_client_cache::acquire(lock_protocol::lockid_t lid)
 {
-  ScopedLock ml(&m);
+  return acquire(lid, false /* shared */);
+}
+
+lock_protocol::status
+lock_client_cache::acquire(lock_protocol::lockid_t lid, bool shared)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   lock_protocol::status ret;
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
-    locks[lid] = lock_t();
-    it = locks.find(lid);
+  if (it == s.locks.end()) {
+    it = s.locks.insert(std::make_pair(lid, lock_t())).first;
   }
 
   while (true) {
     switch (it->second.status) {
       case lock_status::none: {
-        ret = acquire_impl(lid, it);
+        ret = acquire_impl(lid, s, it, shared);
         if (ret != lock_protocol::OK) {
           return ret;
         }
@@ -126,6 +145,14 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
       }
 
       case lock_status::free: {
+        if (it->second.shared && !shared) {
+          // Give the shared lock back and ask for an exclusive one.
+          ret = release_impl(lid, s, it);
+          if (ret != lock_protocol::OK) {
+            return ret;
+          }
+          continue;
+        }
         it->second.status = lock_status::locked;
         it->second.owner = pthread_self();
         return lock_protocol::OK;
@@ -135,31 +162,119 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
       case lock_status::acquiring:
       case lock_status::releasing: {
         while (it->second.status != lock_status::free && it->second.status != lock_status::none) {
-          pthread_cond_wait(&it->second.free_c, &m);
+          pthread_cond_wait(&it->second.free_c, &s.m);
         }
-        if (it->second.status == lock_status::none) {
-          continue;  // acquire the lock in next while loop.
-        }
-        it->second.status = lock_status::locked;
-        it->second.owner = pthread_self();
-        return lock_protocol::OK;
+        continue;  // take or acquire the lock in next while loop.
+      }
+    }
+  }
+
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_client_cache::acquire_multi(std::vector<lock_protocol::lockid_t> lids)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  prefetch(lids);
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    lock_protocol::status ret = acquire(lids[i]);
+
+    if (ret != lock_protocol::OK) {
+      while (i-- > 0) {
+        release(lids[i]);
       }
+      return ret;
     }
   }
 
   return lock_protocol::OK;
 }
 
+// Ask the server for all locks in @lids that are not cached in one round
+// trip. Granted locks are cached free, so that acquire takes them without
+// an RPC unless they are revoked in the meantime; the others are left to
+// acquire and its retry.
+void
+lock_client_cache::prefetch(const std::vector<lock_protocol::lockid_t> &lids)
+{
+  std::vector<lock_protocol::lockid_t> want;
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    stripe_t &s = stripe(lids[i]);
+    ScopedLock ml(&s.m);
+
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lids[i]);
+
+    if (it == s.locks.end() || it->second.status == lock_status::none) {
+      want.push_back(lids[i]);
+    }
+  }
+  if (want.size() < 2) {
+    return;
+  }
+
+  // Locks that another thread started to acquire in the meantime are
+  // left to acquire.
+  for (unsigned int i = 0; i < want.size(); ) {
+    stripe_t &s = stripe(want[i]);
+    ScopedLock ml(&s.m);
+
+    lock_t &l = s.locks[want[i]];
+
+    if (l.status == lock_status::none) {
+      l.status = lock_status::acquiring;
+      ++i;
+    } else {
+      want.erase(want.begin() + i);
+    }
+  }
+
+  std::map<lock_protocol::lockid_t, int> granted;
+  lock_protocol::status ret;
+
+  ret = cl->call(lock_protocol::acquire_multi, want, id, granted);
+
+  for (unsigned int i = 0; i < want.size(); ++i) {
+    stripe_t &s = stripe(want[i]);
+    ScopedLock ml(&s.m);
+
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(want[i]);
+    std::map<lock_protocol::lockid_t, int>::iterator g = granted.find(want[i]);
+
+    if ((ret == lock_protocol::OK || ret == lock_protocol::RETRY) && g != granted.end()) {
+      it->second.status = lock_status::free;
+      it->second.shared = false;
+      if (g->second) { // other clients are also waiting for the lock.
+        it->second.revoked = true;
+      }
+      if (it->second.revoked) {
+        // Holding a lock that others wait for while this thread waits for
+        // lower ones could deadlock; give it back and ask again in order.
+        release_impl(want[i], s, it);
+      }
+    } else {
+      it->second.status = lock_status::none;
+    }
+
+    pthread_cond_signal(&it->second.free_c);
+  }
+}
+
 // Return the lock to server if @flush is true.
 lock_protocol::status
 lock_client_cache::release(lock_protocol::lockid_t lid, bool flush)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   lock_protocol::status ret;
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end() || it->second.status != lock_status::locked) {
+  if (it == s.locks.end() || it->second.status != lock_status::locked) {
     tprintf("lock %lld is not found or bad status.\n", lid);
     return lock_protocol::RPCERR;
   }
@@ -169,7 +284,7 @@ lock_client_cache::release(lock_protocol::lockid_t lid, bool flush)
   }
 
   if (it->second.revoked || flush) {
-    ret = release_impl(lid, it);
+    ret = release_impl(lid, s, it);
     if (ret != lock_protocol::OK) {
       return ret;
     }
@@ -189,20 +304,70 @@ lock_client_cache::release(lock_protocol::lockid_t lid)
   return release(lid, false /* flush */);
 }
 
+// Returns RETRY if a thread holds the lock and NOENT if it is not cached.
+lock_protocol::status
+lock_client_cache::try_acquire(lock_protocol::lockid_t lid)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
+
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+
+  if (it == s.locks.end() || it->second.status == lock_status::none) {
+    return lock_protocol::NOENT;
+  }
+  if (it->second.status != lock_status::free) {
+    return lock_protocol::RETRY;
+  }
+
+  it->second.status = lock_status::locked;
+  it->second.owner = pthread_self();
+
+  return lock_protocol::OK;
+}
+
+// Returns RETRY if a thread holds the lock and NOENT if it is not cached.
+lock_protocol::status
+lock_client_cache::release_early(lock_protocol::lockid_t lid)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
+
+  lock_protocol::status ret;
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+
+  if (it == s.locks.end() || it->second.status == lock_status::none) {
+    return lock_protocol::NOENT;
+  }
+  if (it->second.status != lock_status::free) {
+    return lock_protocol::RETRY;
+  }
+
+  ret = release_impl(lid, s, it);
+  if (ret != lock_protocol::OK) {
+    return ret;
+  }
+
+  pthread_cond_signal(&it->second.free_c);
+
+  return lock_protocol::OK;
+}
+
 rlock_protocol::status
 lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int &)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
+  if (it == s.locks.end()) {
     tprintf("lock %lld not found.\n", lid);
     return lock_protocol::RPCERR;
   }
 
   if (it->second.status == lock_status::free) {
-    if (release_impl(lid, it) != lock_protocol::OK) {
+    if (release_impl(lid, s, it) != lock_protocol::OK) {
       return rlock_protocol::RPCERR;
     }
 
@@ -216,11 +381,12 @@ lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int &)
 rlock_protocol::status
 lock_client_cache::retry_handler(lock_protocol::lockid_t lid, int &)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
+  if (it == s.locks.end()) {
     tprintf("lock %lld not found.\n", lid);
     return rlock_protocol::RPCERR;
   }
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
@@ -32,6 +33,7 @@ class lock_client_cache : public lock_client {
   struct lock_t {
     lock_status status;
 
+    bool shared;            // the client caches the lock for reading only
     bool revoked;
     bool should_retry;
 
@@ -42,7 +44,7 @@ class lock_client_cache : public lock_client {
 
     lock_t()
       : status(lock_status::none),
-        revoked(false), should_retry(false), owner(0) {
+        shared(false), revoked(false), should_retry(false), owner(0) {
           pthread_cond_init(&free_c, NULL);
           pthread_cond_init(&retry_c, NULL);
     }
@@ -50,9 +52,19 @@ class lock_client_cache : public lock_client {
 
   class lock_release_user *lu;
   std::string id;
-  std::map<lock_protocol::lockid_t, lock_t> locks;
 
-  pthread_mutex_t m;
+  // The lock table is partitioned by id into stripes with a mutex each, so
+  // threads working on different locks seldom contend. A lock's condition
+  // variables wait on the mutex of its stripe.
+  static const unsigned int NSTRIPES = 16;
+
+  struct stripe_t {
+    pthread_mutex_t m;
+    std::map<lock_protocol::lockid_t, lock_t> locks;
+  };
+  stripe_t stripes[NSTRIPES];
+
+  stripe_t &stripe(lock_protocol::lockid_t);
 
  public:
   lock_client_cache(std::string xdst, class lock_release_user *l = NULL);
@@ -60,19 +72,32 @@ class lock_client_cache : public lock_client {
 
   int stat(lock_protocol::lockid_t);
   lock_protocol::status acquire(lock_protocol::lockid_t);
+  // With @shared, the lock is cached in shared mode, which the server may
+  // lend to other clients at the same time; only exclusive acquires
+  // revoke it. Threads of this client still hold the lock one at a time.
+  lock_protocol::status acquire(lock_protocol::lockid_t, bool shared);
+  // Acquire all locks in @lids exclusively, in increasing order so that
+  // threads taking several locks cannot deadlock. Locks that are not
+  // cached are asked for in a single acquire_multi RPC.
+  lock_protocol::status acquire_multi(std::vector<lock_protocol::lockid_t> lids);
   lock_protocol::status release(lock_protocol::lockid_t);
   lock_protocol::status release(lock_protocol::lockid_t, bool);
+  // Take the lock only if it is cached and free, never ask the server.
+  lock_protocol::status try_acquire(lock_protocol::lockid_t);
+  // Give a cached lock that no thread holds back to the server now.
+  lock_protocol::status release_early(lock_protocol::lockid_t);
 
   rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int &);
   rlock_protocol::status retry_handler(lock_protocol::lockid_t, int &);
 
  private:
   lock_protocol::status acquire_impl(
-      lock_protocol::lockid_t,
-      std::map<lock_protocol::lockid_t, lock_t>::iterator);
+      lock_protocol::lockid_t, stripe_t &,
+      std::map<lock_protocol::lockid_t, lock_t>::iterator, bool shared);
   lock_protocol::status release_impl(
-      lock_protocol::lockid_t lid,
+      lock_protocol::lockid_t lid, stripe_t &,
       std::map<lock_protocol::lockid_t, lock_t>::iterator);
+  void prefetch(const std::vector<lock_protocol::lockid_t> &);
 };
 
 #endif
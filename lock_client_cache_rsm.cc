@@ -6,11 +6,23 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <algorithm>
+#include <set>
+#include <unistd.h>
 #include "tprintf.h"
 
 #include "rsm_client.h"
 
 int lock_client_cache_rsm::last_port = 0;
+const unsigned int lock_client_cache_rsm::DROP_MARGIN;
+
+static void *
+leasethread(void *x)
+{
+  lock_client_cache_rsm *cc = (lock_client_cache_rsm *) x;
+  cc->leaser();
+  return 0;
+}
 
 lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst, class lock_release_user *_lu)
   : lu(_lu)
@@ -24,36 +36,63 @@ lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst, class lock_releas
   rpcs *rlsrpc = new rpcs(rlock_port);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache_rsm::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache_rsm::retry_handler);
+  rlsrpc->reg(rlock_protocol::revoke_multi, this, &lock_client_cache_rsm::revoke_multi_handler);
+  rlsrpc->reg(rlock_protocol::retry_multi, this, &lock_client_cache_rsm::retry_multi_handler);
 
   xid = 0;
+  pthread_mutex_init(&xid_m, NULL);
 
-  pthread_mutex_init(&m, NULL);
+  for (unsigned int i = 0; i < NSTRIPES; ++i) {
+    pthread_mutex_init(&stripes[i].m, NULL);
+  }
 
   rsmc = new rsm_client(xdst);
+
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, &leasethread, (void *) this) == 0);
 }
 
 // We don't need releaser thread here. Check the step one guidance for details.
 // https://pdos.csail.mit.edu/archive/6.824-2012/labs/lab-7.html.
 
+lock_client_cache_rsm::stripe_t &
+lock_client_cache_rsm::stripe(lock_protocol::lockid_t lid)
+{
+  // Inums are handed out in sequential ranges, mix the bits so that they
+  // spread over the stripes.
+  return stripes[((lid * 0x9e3779b97f4a7c15ULL) >> 32) % NSTRIPES];
+}
+
+lock_protocol::xid_t
+lock_client_cache_rsm::next_xid()
+{
+  ScopedLock ml(&xid_m);
+  return ++xid;
+}
+
 lock_protocol::status
 lock_client_cache_rsm::acquire_impl(
-    lock_protocol::lockid_t lid,
-    std::map<lock_protocol::lockid_t, lock_t>::iterator it)
+    lock_protocol::lockid_t lid, stripe_t &s,
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it, bool shared)
 {
   VERIFY(it->second.status == lock_status::none);
 
   it->second.status = lock_status::acquiring;
 
   lock_protocol::status ret;
+  time_t start;
   int r = 0;
 
   while (true) {
-    // Assign a new sequence number for this acquire.
-    xid += 1;
+    // Assign a new sequence number for this acquire. Other threads may
+    // take the next one while the call is in flight.
+    lock_protocol::xid_t cur = next_xid();
 
-    pthread_mutex_unlock(&m);
-    ret = rsmc->call(lock_protocol::acquire, lid, id, xid, r);
-    pthread_mutex_lock(&m);
+    start = time(NULL);
+    pthread_mutex_unlock(&s.m);
+    ret = rsmc->call((shared ? lock_protocol::acquire_shared
+                                       : lock_protocol::acquire), lid, id, cur, r);
+    pthread_mutex_lock(&s.m);
 
     if (ret == lock_protocol::OK || ret != lock_protocol::RETRY) {
       break;
@@ -69,7 +108,7 @@ lock_client_cache_rsm::acquire_impl(
     while (!it->second.should_retry) {
       // Retry automatically every 3 seconds.
       // TODO: what if spurious wakeup?
-      if (pthread_cond_timedwait(&it->second.retry_c, &m, &next_timeout) == ETIMEDOUT) {
+      if (pthread_cond_timedwait(&it->second.retry_c, &s.m, &next_timeout) == ETIMEDOUT) {
         break;
       }
     }
@@ -78,6 +117,8 @@ lock_client_cache_rsm::acquire_impl(
 
   if (ret == lock_protocol::OK) {
     it->second.status = lock_status::free;
+    it->second.shared = shared;
+    it->second.lease_end = start + lock_protocol::lease_time;
     if (r) { // other clients are also waiting for the lock.
       it->second.revoked = true;
     }
@@ -88,10 +129,32 @@ lock_client_cache_rsm::acquire_impl(
   return ret;
 }
 
+// Let the lock user write back what it cached under lock @l, or throw it
+// away if the server may have given the lock to another client, i.e. if
+// it reported the lease lost or the lease ran out. Returns whether it was
+// thrown away.
+bool
+lock_client_cache_rsm::release_user(lock_protocol::lockid_t lid, lock_t &l)
+{
+  bool lost = l.lost || time(NULL) >= l.lease_end;
+
+  if (lost) {
+    tprintf("lease of lock %lld was lost, discarding its cache.\n", lid);
+  }
+  if (lu != NULL) {
+    if (lost) {
+      lu->dodiscard(lid);
+    } else {
+      lu->dorelease(lid);
+    }
+  }
+  return lost;
+}
+
 lock_protocol::status
 lock_client_cache_rsm::release_impl(
-    lock_protocol::lockid_t lid,
-    std::map<lock_protocol::lockid_t, lock_t>::iterator it)
+    lock_protocol::lockid_t lid, stripe_t &s,
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it, bool *discarded)
 {
   lock_status status = it->second.status;
 
@@ -99,23 +162,28 @@ lock_client_cache_rsm::release_impl(
 
   it->second.status = lock_status::releasing;
 
-  if (lu != NULL) {
-    lu->dorelease(lid);
+  bool lost = release_user(lid, it->second);
+  if (discarded != NULL) {
+    *discarded = lost;
   }
 
   // Assign a new sequence number for this release.
-  xid += 1;
+  lock_protocol::xid_t cur = next_xid();
 
   lock_protocol::status ret;
   int r;
 
-  pthread_mutex_unlock(&m);
-  ret = rsmc->call(lock_protocol::release, lid, id, xid, r);
-  pthread_mutex_lock(&m);
+  pthread_mutex_unlock(&s.m);
+  ret = rsmc->call(lock_protocol::release, lid, id, cur, r);
+  pthread_mutex_lock(&s.m);
 
-  if (ret == lock_protocol::OK) {
+  // RPCERR means the server no longer lends the lock to this client,
+  // e.g. because its lease ran out.
+  if (ret == lock_protocol::OK || ret == lock_protocol::RPCERR) {
+    ret = lock_protocol::OK;
     it->second.owner = 0;
     it->second.revoked = false;
+    it->second.lost = false;
     it->second.status = lock_status::none;
   } else {
     it->second.status = status; // fail to release, keep it as old status.
@@ -127,31 +195,54 @@ lock_client_cache_rsm::release_impl(
 lock_protocol::status
 lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
 {
-  ScopedLock ml(&m);
+  return acquire(lid, false /* shared */);
+}
+
+lock_protocol::status
+lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid, bool shared)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   lock_protocol::status ret;
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
-    locks[lid] = lock_t();
-    it = locks.find(lid);
+  if (it == s.locks.end()) {
+    it = s.locks.insert(std::make_pair(lid, lock_t())).first;
   }
 
   while (true) {
     switch (it->second.status) {
       case lock_status::none: {
-        ret = acquire_impl(lid, it);
+        ret = acquire_impl(lid, s, it, shared);
         if (ret != lock_protocol::OK) {
           return ret;
         }
         it->second.status = lock_status::locked;
         it->second.owner = pthread_self();
+        it->second.used = true;
         return lock_protocol::OK;
       }
 
       case lock_status::free: {
+        if (it->second.shared && !shared) {
+          // Give the shared lock back and ask for an exclusive one.
+          ret = release_impl(lid, s, it);
+          if (ret != lock_protocol::OK) {
+            return ret;
+          }
+          continue;
+        }
+        if (expiring(it->second, time(NULL))) {
+          // The leaser may not have had the chance to drop it, e.g. while
+          // a renew waits out a view change; the server may take the lock
+          // back any moment, so ask for it again.
+          drop_impl(lid, it);
+          continue;
+        }
         it->second.status = lock_status::locked;
         it->second.owner = pthread_self();
+        it->second.used = true;
         return lock_protocol::OK;
       }
 
@@ -159,30 +250,123 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
       case lock_status::acquiring:
       case lock_status::releasing: {
         while (it->second.status != lock_status::free && it->second.status != lock_status::none) {
-          pthread_cond_wait(&it->second.free_c, &m);
+          pthread_cond_wait(&it->second.free_c, &s.m);
         }
-        if (it->second.status == lock_status::none) {
-          continue;  // acquire the lock in next while loop.
-        }
-        it->second.status = lock_status::locked;
-        it->second.owner = pthread_self();
-        return lock_protocol::OK;
+        continue;  // take or acquire the lock in next while loop.
+      }
+    }
+  }
+
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_client_cache_rsm::acquire_multi(std::vector<lock_protocol::lockid_t> lids)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  prefetch(lids);
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    lock_protocol::status ret = acquire(lids[i]);
+
+    if (ret != lock_protocol::OK) {
+      while (i-- > 0) {
+        release(lids[i]);
       }
+      return ret;
     }
   }
 
   return lock_protocol::OK;
 }
 
+// Ask the server for all locks in @lids that are not cached in one round
+// trip. Granted locks are cached free, so that acquire takes them without
+// an RPC unless they are revoked in the meantime; the others are left to
+// acquire and its retry.
+void
+lock_client_cache_rsm::prefetch(const std::vector<lock_protocol::lockid_t> &lids)
+{
+  std::vector<lock_protocol::lockid_t> want;
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    stripe_t &s = stripe(lids[i]);
+    ScopedLock ml(&s.m);
+
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lids[i]);
+
+    if (it == s.locks.end() || it->second.status == lock_status::none) {
+      want.push_back(lids[i]);
+    }
+  }
+  if (want.size() < 2) {
+    return;
+  }
+
+  // Locks that another thread started to acquire in the meantime are
+  // left to acquire.
+  for (unsigned int i = 0; i < want.size(); ) {
+    stripe_t &s = stripe(want[i]);
+    ScopedLock ml(&s.m);
+
+    lock_t &l = s.locks[want[i]];
+
+    if (l.status == lock_status::none) {
+      l.status = lock_status::acquiring;
+      ++i;
+    } else {
+      want.erase(want.begin() + i);
+    }
+  }
+
+  // Assign a new sequence number for this acquire.
+  lock_protocol::xid_t cur = next_xid();
+  std::map<lock_protocol::lockid_t, int> granted;
+  lock_protocol::status ret;
+  time_t start = time(NULL);
+
+  ret = rsmc->call(lock_protocol::acquire_multi, want, id, cur, granted);
+
+  for (unsigned int i = 0; i < want.size(); ++i) {
+    stripe_t &s = stripe(want[i]);
+    ScopedLock ml(&s.m);
+
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(want[i]);
+    std::map<lock_protocol::lockid_t, int>::iterator g = granted.find(want[i]);
+
+    if ((ret == lock_protocol::OK || ret == lock_protocol::RETRY) && g != granted.end()) {
+      it->second.status = lock_status::free;
+      it->second.shared = false;
+      it->second.lease_end = start + lock_protocol::lease_time;
+      if (g->second) { // other clients are also waiting for the lock.
+        it->second.revoked = true;
+      }
+      if (it->second.revoked) {
+        // Holding a lock that others wait for while this thread waits for
+        // lower ones could deadlock; give it back and ask again in order.
+        release_impl(want[i], s, it);
+      }
+    } else {
+      it->second.status = lock_status::none;
+    }
+
+    pthread_cond_signal(&it->second.free_c);
+  }
+}
+
 lock_protocol::status
 lock_client_cache_rsm::release(lock_protocol::lockid_t lid, bool flush)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   lock_protocol::status ret;
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  bool discarded = false;
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end() || it->second.status != lock_status::locked) {
+  if (it == s.locks.end() || it->second.status != lock_status::locked) {
     tprintf("lock %lld is not found or bad status.\n", lid);
     return lock_protocol::RPCERR;
   }
@@ -191,8 +375,11 @@ lock_client_cache_rsm::release(lock_protocol::lockid_t lid, bool flush)
     return lock_protocol::RPCERR;
   }
 
-  if (it->second.revoked || flush) {
-    ret = release_impl(lid, it);
+  // A lock whose lease was lost or ran out is never kept cached; what was
+  // done under it is discarded.
+  if (it->second.revoked || flush || it->second.lost ||
+      time(NULL) >= it->second.lease_end) {
+    ret = release_impl(lid, s, it, &discarded);
     if (ret != lock_protocol::OK) {
       return ret;
     }
@@ -203,7 +390,7 @@ lock_client_cache_rsm::release(lock_protocol::lockid_t lid, bool flush)
 
   pthread_cond_signal(&it->second.free_c);
 
-  return lock_protocol::OK;
+  return discarded ? lock_protocol::STALE : lock_protocol::OK;
 }
 
 lock_protocol::status
@@ -212,21 +399,171 @@ lock_client_cache_rsm::release(lock_protocol::lockid_t lid)
   return release(lid, false /* flush */);
 }
 
+lock_protocol::status
+lock_client_cache_rsm::stat(lock_protocol::lockid_t lid, int &r)
+{
+  return rsmc->call(lock_protocol::stat, lid, r);
+}
+
+// Returns RETRY if a thread holds the lock and NOENT if it is not cached.
+lock_protocol::status
+lock_client_cache_rsm::try_acquire(lock_protocol::lockid_t lid)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
+
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+
+  if (it == s.locks.end() || it->second.status == lock_status::none) {
+    return lock_protocol::NOENT;
+  }
+  if (it->second.status != lock_status::free || expiring(it->second, time(NULL))) {
+    return lock_protocol::RETRY;
+  }
+
+  it->second.status = lock_status::locked;
+  it->second.owner = pthread_self();
+
+  return lock_protocol::OK;
+}
+
+// Returns RETRY if a thread holds the lock and NOENT if it is not cached.
+lock_protocol::status
+lock_client_cache_rsm::release_early(lock_protocol::lockid_t lid)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
+
+  lock_protocol::status ret;
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+
+  if (it == s.locks.end() || it->second.status == lock_status::none) {
+    return lock_protocol::NOENT;
+  }
+  if (it->second.status != lock_status::free) {
+    return lock_protocol::RETRY;
+  }
+
+  ret = release_impl(lid, s, it);
+  if (ret != lock_protocol::OK) {
+    return ret;
+  }
+
+  pthread_cond_signal(&it->second.free_c);
+
+  return lock_protocol::OK;
+}
+
+// Forget a cached lock that no thread holds without telling the server,
+// which takes it back once the lease runs out.
+void
+lock_client_cache_rsm::drop_impl(
+    lock_protocol::lockid_t lid,
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it)
+{
+  VERIFY(it->second.status == lock_status::free);
+
+  it->second.status = lock_status::releasing;
+
+  release_user(lid, it->second);
+
+  it->second.owner = 0;
+  it->second.revoked = false;
+  it->second.lost = false;
+  it->second.status = lock_status::none;
+
+  pthread_cond_signal(&it->second.free_c);
+}
+
+// Once a second, renew in one RPC the leases that run out within half a
+// lease time of the cached locks that a thread holds or that were used
+// since they were last renewed. Free locks that were not used are
+// dropped instead, DROP_MARGIN seconds before their leases run out.
+void
+lock_client_cache_rsm::leaser()
+{
+  while (true) {
+    sleep(1);
+
+    std::vector<lock_protocol::lockid_t> lids;
+    time_t now = time(NULL);
+
+    for (unsigned int i = 0; i < NSTRIPES; ++i) {
+      stripe_t &s = stripes[i];
+      ScopedLock ml(&s.m);
+
+      std::map<lock_protocol::lockid_t, lock_t>::iterator it;
+      for (it = s.locks.begin(); it != s.locks.end(); ++it) {
+        lock_t &l = it->second;
+
+        if ((l.status != lock_status::free && l.status != lock_status::locked) ||
+            l.lease_end - now > (time_t) lock_protocol::lease_time / 2) {
+          continue;
+        }
+
+        if (l.status == lock_status::locked || l.used) {
+          lids.push_back(it->first);
+        } else if (expiring(l, now)) {
+          tprintf("dropping lock %lld before its lease runs out.\n", it->first);
+          drop_impl(it->first, it);
+        }
+      }
+    }
+
+    if (lids.empty()) {
+      continue;
+    }
+
+    std::vector<lock_protocol::lockid_t> lost;
+    time_t start = time(NULL);
+
+    if (rsmc->call(lock_protocol::renew, lids, id, lost) != lock_protocol::OK) {
+      continue;
+    }
+
+    std::set<lock_protocol::lockid_t> lost_set(lost.begin(), lost.end());
+
+    for (unsigned int i = 0; i < lids.size(); ++i) {
+      stripe_t &s = stripe(lids[i]);
+      ScopedLock ml(&s.m);
+
+      std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lids[i]);
+      lock_t &l = it->second;
+
+      if (l.status != lock_status::free && l.status != lock_status::locked) {
+        continue;  // released in the meantime
+      }
+
+      if (lost_set.count(lids[i]) == 0) {
+        l.lease_end = std::max(l.lease_end, start + (time_t) lock_protocol::lease_time);
+        l.used = false;
+      } else {
+        tprintf("lease of lock %lld was lost.\n", lids[i]);
+        l.lost = true;
+        if (l.status == lock_status::free) {
+          drop_impl(lids[i], it);
+        }
+      }
+    }
+  }
+}
+
 // XXX: Do we really need xid here?
 rlock_protocol::status
 lock_client_cache_rsm::revoke_handler(lock_protocol::lockid_t lid, lock_protocol::xid_t, int &)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
+  if (it == s.locks.end()) {
     tprintf("lock %lld not found.\n", lid);
     return lock_protocol::RPCERR;
   }
 
   if (it->second.status == lock_status::free) {
-    if (release_impl(lid, it) != lock_protocol::OK) {
+    if (release_impl(lid, s, it) != lock_protocol::OK) {
       return rlock_protocol::RPCERR;
     }
 
@@ -240,11 +577,12 @@ lock_client_cache_rsm::revoke_handler(lock_protocol::lockid_t lid, lock_protocol
 rlock_protocol::status
 lock_client_cache_rsm::retry_handler(lock_protocol::lockid_t lid, lock_protocol::xid_t, int &)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
 
-  if (it == locks.end()) {
+  if (it == s.locks.end()) {
     tprintf("lock %lld not found.\n", lid);
     return rlock_protocol::RPCERR;
   }
@@ -254,3 +592,33 @@ lock_client_cache_rsm::retry_handler(lock_protocol::lockid_t lid, lock_protocol:
 
   return rlock_protocol::OK;
 }
+
+rlock_protocol::status
+lock_client_cache_rsm::revoke_multi_handler(std::vector<lock_protocol::lockid_t> lids,
+                                            lock_protocol::xid_t xid, int &r)
+{
+  rlock_protocol::status ret = rlock_protocol::OK;
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    if (revoke_handler(lids[i], xid, r) != rlock_protocol::OK) {
+      ret = rlock_protocol::RPCERR;
+    }
+  }
+
+  return ret;
+}
+
+rlock_protocol::status
+lock_client_cache_rsm::retry_multi_handler(std::vector<lock_protocol::lockid_t> lids,
+                                           lock_protocol::xid_t xid, int &r)
+{
+  rlock_protocol::status ret = rlock_protocol::OK;
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    if (retry_handler(lids[i], xid, r) != rlock_protocol::OK) {
+      ret = rlock_protocol::RPCERR;
+    }
+  }
+
+  return ret;
+}
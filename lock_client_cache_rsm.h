@@ -5,6 +5,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
@@ -15,9 +16,13 @@
 // Classes that inherit lock_release_user can override dorelease so that
 // that they will be called when lock_client releases a lock.
 // You will not need to do anything with this class until Lab 5.
+// dodiscard is called instead when the lock's lease was lost, so the
+// server may have given it to another client: anything cached under the
+// lock must be thrown away rather than written back.
 class lock_release_user {
  public:
   virtual void dorelease(lock_protocol::lockid_t) = 0;
+  virtual void dodiscard(lock_protocol::lockid_t) = 0;
   virtual ~lock_release_user() { }
 };
 
@@ -40,6 +45,7 @@ class lock_client_cache_rsm {
   struct lock_t {
     lock_status status;
 
+    bool shared;            // the client caches the lock for reading only
     bool revoked;
     bool should_retry;
 
@@ -48,9 +54,14 @@ class lock_client_cache_rsm {
 
     pthread_t owner;        // thread id of owner
 
+    time_t lease_end;       // when the lease runs out, while cached
+    bool used;              // taken since the lease was last renewed
+    bool lost;              // the server took the lock back while cached
+
     lock_t()
       : status(lock_status::none),
-        revoked(false), should_retry(false), owner(0) {
+        shared(false), revoked(false), should_retry(false), owner(0),
+        lease_end(0), used(false), lost(false) {
           pthread_cond_init(&free_c, NULL);
           pthread_cond_init(&retry_c, NULL);
     }
@@ -59,9 +70,25 @@ class lock_client_cache_rsm {
   class lock_release_user *lu;
   std::string id;
   lock_protocol::xid_t xid;
-  std::map<lock_protocol::lockid_t, lock_t> locks;
+  pthread_mutex_t xid_m;   // protects xid
+
+  // The lock table is partitioned by id into stripes with a mutex each, so
+  // threads working on different locks seldom contend. A lock's condition
+  // variables wait on the mutex of its stripe.
+  static const unsigned int NSTRIPES = 16;
+
+  struct stripe_t {
+    pthread_mutex_t m;
+    std::map<lock_protocol::lockid_t, lock_t> locks;
+  };
+  stripe_t stripes[NSTRIPES];
+
+  // Free locks that were not used are dropped this many seconds before
+  // their leases run out.
+  static const unsigned int DROP_MARGIN = 2;
 
-  pthread_mutex_t m;
+  stripe_t &stripe(lock_protocol::lockid_t);
+  lock_protocol::xid_t next_xid();
 
  public:
   static int last_port;
@@ -70,19 +97,48 @@ class lock_client_cache_rsm {
   virtual ~lock_client_cache_rsm() { }
 
   lock_protocol::status acquire(lock_protocol::lockid_t);
+  // With @shared, the lock is cached in shared mode, which the server may
+  // lend to other clients at the same time; only exclusive acquires
+  // revoke it. Threads of this client still hold the lock one at a time.
+  lock_protocol::status acquire(lock_protocol::lockid_t, bool shared);
+  // Acquire all locks in @lids exclusively, in increasing order so that
+  // threads taking several locks cannot deadlock. Locks that are not
+  // cached are asked for in a single acquire_multi RPC.
+  lock_protocol::status acquire_multi(std::vector<lock_protocol::lockid_t> lids);
+  // Returns STALE if the lease was lost while the thread held the lock;
+  // what was cached under it has been discarded.
   lock_protocol::status release(lock_protocol::lockid_t);
   lock_protocol::status release(lock_protocol::lockid_t, bool);
+  // Take the lock only if it is cached and free, never ask the server.
+  lock_protocol::status try_acquire(lock_protocol::lockid_t);
+  // Give a cached lock that no thread holds back to the server now.
+  lock_protocol::status release_early(lock_protocol::lockid_t);
+  // @r returns the number of clients the server lends the lock to.
+  lock_protocol::status stat(lock_protocol::lockid_t, int &r);
+
+  void leaser();
 
   rlock_protocol::status revoke_handler(lock_protocol::lockid_t, lock_protocol::xid_t, int &);
   rlock_protocol::status retry_handler(lock_protocol::lockid_t, lock_protocol::xid_t, int &);
+  rlock_protocol::status revoke_multi_handler(std::vector<lock_protocol::lockid_t>,
+                                              lock_protocol::xid_t, int &);
+  rlock_protocol::status retry_multi_handler(std::vector<lock_protocol::lockid_t>,
+                                             lock_protocol::xid_t, int &);
 
  private:
   lock_protocol::status acquire_impl(
-      lock_protocol::lockid_t,
-      std::map<lock_protocol::lockid_t, lock_t>::iterator);
+      lock_protocol::lockid_t, stripe_t &,
+      std::map<lock_protocol::lockid_t, lock_t>::iterator, bool shared);
   lock_protocol::status release_impl(
-      lock_protocol::lockid_t lid,
-      std::map<lock_protocol::lockid_t, lock_t>::iterator);
+      lock_protocol::lockid_t lid, stripe_t &,
+      std::map<lock_protocol::lockid_t, lock_t>::iterator, bool *discarded = NULL);
+  void prefetch(const std::vector<lock_protocol::lockid_t> &);
+  void drop_impl(lock_protocol::lockid_t, std::map<lock_protocol::lockid_t, lock_t>::iterator);
+  bool release_user(lock_protocol::lockid_t, lock_t &);
+  // A free lock must not be taken once its lease is about to run out.
+  static bool expiring(const lock_t &l, time_t now) {
+    return l.lease_end - now <= (time_t) DROP_MARGIN;
+  }
 };
 
 #endif
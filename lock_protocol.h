@@ -11,10 +11,19 @@ class lock_protocol {
   typedef int status;
   typedef unsigned long long lockid_t;
   typedef unsigned long long xid_t;
+  // A granted lock is leased to the client for lease_time seconds from
+  // when it sent the request. The client renews the leases of the locks
+  // it keeps using and drops the others locally before they run out; the
+  // server then takes them back without a revoke.
+  static const unsigned int lease_time = 10;
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    acquire_shared, // may be lent to several clients at once for reading
+    acquire_multi,  // several exclusive locks in one round trip
+    renew,          // extend the leases of several locks
+    expire          // sent by the primary to itself for leases that ran out
   };
 };
 
@@ -24,7 +33,9 @@ class rlock_protocol {
   typedef int status;
   enum rpc_numbers {
     revoke = 0x8001,
-    retry = 0x8002
+    retry = 0x8002,
+    revoke_multi, // revoke or retry several locks in one call
+    retry_multi
   };
 };
 
@@ -11,105 +11,222 @@
 
 lock_server_cache::lock_server_cache()
 {
-  pthread_mutex_init(&m, NULL);
+  for (unsigned int i = 0; i < NSTRIPES; ++i) {
+    pthread_mutex_init(&stripes[i].m, NULL);
+  }
+}
+
+lock_server_cache::stripe_t &
+lock_server_cache::stripe(lock_protocol::lockid_t lid)
+{
+  // Inums are handed out in sequential ranges, mix the bits so that they
+  // spread over the stripes.
+  return stripes[((lid * 0x9e3779b97f4a7c15ULL) >> 32) % NSTRIPES];
 }
 
 lock_protocol::status
 lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, int &r)
 {
-  ScopedLock ml(&m);
+  return acquire_impl(lid, id, false /* shared */, r);
+}
+
+lock_protocol::status
+lock_server_cache::acquire_shared(lock_protocol::lockid_t lid, std::string id, int &r)
+{
+  return acquire_impl(lid, id, true /* shared */, r);
+}
 
-  tprintf("acquire request of lock %lld from client %s.\n", lid, id.c_str());
+// Returns OK if all locks were granted and RETRY if some were not; the
+// client gets a retry for each of those as usual.
+lock_protocol::status
+lock_server_cache::acquire_multi(std::vector<lock_protocol::lockid_t> lids,
+                                 std::string id,
+                                 std::map<lock_protocol::lockid_t, int> &r)
+{
+  lock_protocol::status ret = lock_protocol::OK;
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
-  if (it == locks.end()) {
-    locks[lid] = lock_t();
-    it = locks.find(lid);
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    int waiting = 0;
+    lock_protocol::status s = acquire_impl(lids[i], id, false /* shared */, waiting);
+
+    if (s == lock_protocol::OK) {
+      r[lids[i]] = waiting;
+    } else if (ret == lock_protocol::OK || s != lock_protocol::RETRY) {
+      ret = s;
+    }
   }
 
-  while (true) {
-    switch (it->second.status) {
-      case lock_status::free: {
-        it->second.status = lock_status::lent;
-        it->second.nacquire += 1;
-        it->second.owner = id;
-        r = !it->second.wait_q.empty();
-        tprintf("lock %lld is owned by %s now.\n", lid, it->second.owner.c_str());
-        return lock_protocol::OK;
-      }
+  return ret;
+}
+
+// A shared lock is lent to every client that asks for it while no client
+// holds or waits for the lock exclusively. A client that asks for an
+// exclusive lock has the lock revoked from its owner or from all readers;
+// readers that come after it wait until it is done.
+lock_protocol::status
+lock_server_cache::acquire_impl(lock_protocol::lockid_t lid, std::string id,
+                                bool shared, int &r)
+{
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
+
+  tprintf("acquire request of %s lock %lld from client %s.\n",
+          shared ? "shared" : "exclusive", lid, id.c_str());
+
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+  if (it == s.locks.end()) {
+    it = s.locks.insert(std::make_pair(lid, lock_t())).first;
+  }
 
-      case lock_status::lent:
-      case lock_status::revoked: {
-        it->second.wait_q.push(id);
-
-        if (it->second.status == lock_status::lent) {
-          handle h(it->second.owner);
-          rpcc *cl = h.safebind();
-          int r;
-
-          if (cl) {
-            tprintf("revoking lock %lld owned by client %s.\n", lid, it->second.owner.c_str());
-            it->second.status = lock_status::revoked;
-            pthread_mutex_unlock(&m);
-            cl->call(rlock_protocol::revoke, lid, r);
-            pthread_mutex_lock(&m);
-          }
-        }
-
-        return lock_protocol::RETRY;
+  lock_t &l = it->second;
+
+  switch (l.status) {
+    case lock_status::free:
+    case lock_status::shared: {
+      if (shared) {
+        l.status = lock_status::shared;
+        l.readers.insert(id);
+        tprintf("lock %lld is shared by %zu clients now.\n", lid, l.readers.size());
+      } else if (l.status == lock_status::free) {
+        l.status = lock_status::lent;
+        l.owner = id;
+        tprintf("lock %lld is owned by %s now.\n", lid, l.owner.c_str());
+      } else {
+        break;
       }
+
+      l.nacquire += 1;
+      r = !l.wait_q.empty();
+      return lock_protocol::OK;
     }
+
+    case lock_status::lent:
+    case lock_status::revoked:
+    case lock_status::recalled:
+      break;
+  }
+
+  l.wait_q.push(id);
+  if (shared) {
+    l.shared_q.insert(id);
+  } else {
+    l.shared_q.erase(id);
   }
+
+  std::vector<std::string> revoke;
+
+  if (l.status == lock_status::lent) {
+    revoke.push_back(l.owner);
+    l.status = lock_status::revoked;
+  } else if (l.status == lock_status::shared) {
+    revoke.assign(l.readers.begin(), l.readers.end());
+    l.status = lock_status::recalled;
+  }
+
+  for (unsigned int i = 0; i < revoke.size(); ++i) {
+    tprintf("revoking lock %lld held by client %s.\n", lid, revoke[i].c_str());
+    call(lid, revoke[i], rlock_protocol::revoke);
+  }
+
+  return lock_protocol::RETRY;
 }
 
 lock_protocol::status
 lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, int &)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   tprintf("release request of lock %lld from client %s.\n", lid, id.c_str());
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
-  if (it == locks.end() || it->second.status == lock_status::free) {
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+  if (it == s.locks.end() || it->second.status == lock_status::free) {
     tprintf("lock %lld is not found or free.\n", lid);
     return lock_protocol::RPCERR;
   }
-  if (it->second.owner != id) {
-    tprintf("lock %lld is not owned by client %s.\n", lid, id.c_str());
-    return lock_protocol::RPCERR;
+
+  lock_t &l = it->second;
+
+  if (l.status == lock_status::shared || l.status == lock_status::recalled) {
+    if (l.readers.erase(id) == 0) {
+      tprintf("lock %lld is not shared by client %s.\n", lid, id.c_str());
+      return lock_protocol::RPCERR;
+    }
+    if (!l.readers.empty()) {
+      return lock_protocol::OK;
+    }
+  } else {
+    if (l.owner != id) {
+      tprintf("lock %lld is not owned by client %s.\n", lid, id.c_str());
+      return lock_protocol::RPCERR;
+    }
+    l.owner.clear();
   }
 
-  it->second.status = lock_status::free;
-  it->second.owner.clear();
+  l.status = lock_status::free;
+  wake(lid, l);
+
+  return lock_protocol::OK;
+}
 
-  if (!it->second.wait_q.empty()) {
-    std::string next = it->second.wait_q.front();
-    it->second.wait_q.pop();
+// Retry the first waiter of the free lock @l, together with the readers
+// queued right behind it if it wants to read.
+void
+lock_server_cache::wake(lock_protocol::lockid_t lid, lock_t &l)
+{
+  std::vector<std::string> retry;
 
-    handle h(next);
-    rpcc *cl = h.safebind();
-    int r;
+  while (!l.wait_q.empty()) {
+    std::string next = l.wait_q.front();
+    bool shared = l.shared_q.count(next) > 0;
 
-    if (cl) {
-      tprintf("retry lock %lld for client %s.\n", lid, next.c_str());
-      pthread_mutex_unlock(&m);
-      cl->call(rlock_protocol::retry, lid, r);
-      pthread_mutex_lock(&m);
+    if (!retry.empty() && !shared) {
+      break;
+    }
+    l.wait_q.pop();
+    l.shared_q.erase(next);
+    retry.push_back(next);
+
+    if (!shared) {
+      break;
     }
   }
 
-  return lock_protocol::OK;
+  for (unsigned int i = 0; i < retry.size(); ++i) {
+    tprintf("retry lock %lld for client %s.\n", lid, retry[i].c_str());
+    call(lid, retry[i], rlock_protocol::retry);
+  }
+}
+
+// Send a revoke or retry to client @id. Must hold the mutex of the stripe
+// of @lid, which is released during the call.
+void
+lock_server_cache::call(lock_protocol::lockid_t lid, const std::string &id,
+                        unsigned int proc)
+{
+  handle h(id);
+  rpcc *cl = h.safebind();
+  int r;
+
+  if (cl) {
+    stripe_t &s = stripe(lid);
+
+    pthread_mutex_unlock(&s.m);
+    cl->call(proc, lid, r);
+    pthread_mutex_lock(&s.m);
+  }
 }
 
 lock_protocol::status
 lock_server_cache::stat(lock_protocol::lockid_t lid, int &r)
 {
-  ScopedLock ml(&m);
+  stripe_t &s = stripe(lid);
+  ScopedLock ml(&s.m);
 
   tprintf("stat request of lock %lld.\n", lid);
 
-  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
-  if (it == locks.end()) {
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = s.locks.find(lid);
+  if (it == s.locks.end()) {
     r = 0;
   } else {
     r = it->second.nacquire;
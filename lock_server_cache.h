@@ -2,7 +2,9 @@
 #define lock_server_cache_h
 
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_server.h"
@@ -11,28 +13,52 @@
 class lock_server_cache {
  private:
   enum lock_status {
-    free,    // server has the free lock
-    lent,    // lock is lent to some client @owner
-    revoked, // lock is lent but being revoked
+    free,     // server has the free lock
+    lent,     // lock is lent to some client @owner
+    revoked,  // lock is lent but being revoked
+    shared,   // lock is lent to the clients in @readers
+    recalled, // lock is lent to @readers but being revoked from all of them
   };
 
   struct lock_t {
     lock_status status;
     int nacquire;
     std::string owner;
+    std::set<std::string> readers;
     uqueue<std::string> wait_q; // waiting list
+    std::set<std::string> shared_q; // clients in wait_q that want to read
 
     lock_t() : status(lock_status::free), nacquire(0) { }
   };
-  std::map<lock_protocol::lockid_t, lock_t> locks;
 
-  pthread_mutex_t m;
+  // The lock table is partitioned by id into stripes with a mutex each, so
+  // requests on different locks seldom contend.
+  static const unsigned int NSTRIPES = 16;
+
+  struct stripe_t {
+    pthread_mutex_t m;
+    std::map<lock_protocol::lockid_t, lock_t> locks;
+  };
+  stripe_t stripes[NSTRIPES];
+
+  stripe_t &stripe(lock_protocol::lockid_t);
+
+  lock_protocol::status acquire_impl(lock_protocol::lockid_t, std::string,
+                                     bool, int &);
+  void wake(lock_protocol::lockid_t, lock_t &);
+  void call(lock_protocol::lockid_t, const std::string &, unsigned int);
 
  public:
   lock_server_cache();
   lock_protocol::status stat(lock_protocol::lockid_t, int &);
   // The return value indicates if there are other clients trying to acquire the lock.
   lock_protocol::status acquire(lock_protocol::lockid_t, std::string, int &);
+  lock_protocol::status acquire_shared(lock_protocol::lockid_t, std::string, int &);
+  // Acquire every lock in @lids in one round trip. @r tells for each
+  // granted lock whether other clients wait for it; the client is queued
+  // for the others as if it had asked for them one at a time.
+  lock_protocol::status acquire_multi(std::vector<lock_protocol::lockid_t>, std::string,
+                                      std::map<lock_protocol::lockid_t, int> &);
   lock_protocol::status release(lock_protocol::lockid_t, std::string, int &);
 };
 
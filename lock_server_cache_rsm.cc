@@ -10,18 +10,18 @@
 #include "tprintf.h"
 
 static void *
-revokethread(void *x)
+notifythread(void *x)
 {
   lock_server_cache_rsm *sc = (lock_server_cache_rsm *) x;
-  sc->revoker();
+  sc->notifier();
   return 0;
 }
 
 static void *
-retrythread(void *x)
+expirethread(void *x)
 {
   lock_server_cache_rsm *sc = (lock_server_cache_rsm *) x;
-  sc->retryer();
+  sc->expirer();
   return 0;
 }
 
@@ -29,65 +29,103 @@ lock_server_cache_rsm::lock_server_cache_rsm(class rsm *_rsm)
   : rsm (_rsm)
 {
   pthread_mutex_init(&m, NULL);
+  pthread_mutex_init(&pending_m, NULL);
 
   pthread_t th;
 
-  pthread_create(&th, NULL, &revokethread, (void *) this);
-  pthread_create(&th, NULL, &retrythread, (void *) this);
+  for (int i = 0; i < NWORKERS; ++i) {
+    VERIFY(pthread_create(&th, NULL, &notifythread, (void *) this) == 0);
+  }
+  VERIFY(pthread_create(&th, NULL, &expirethread, (void *) this) == 0);
 
   // Register (un)marshal handler to rsm.
   rsm->set_state_transfer(this);
 }
 
+// Queue a revoke or retry (@proc) of lock @lid for @client.
 void
-lock_server_cache_rsm::revoker()
+lock_server_cache_rsm::notify(lock_protocol::lockid_t lid,
+                              const std::string &client, unsigned int proc)
 {
-  // We don't need to hold lock here as revoke_tasks is thread-safe.
-  task_t task;
+  ScopedLock ml(&pending_m);
 
-  while (true) {
-    revoke_tasks.deq(&task);
+  pending_t &p = pending[client];
 
-    if (!rsm->amiprimary()) { // only primary is allowed to contact client.
-      continue;
-    }
-
-    handle h(task.client);
-    rpcc *cl = h.safebind();
-    int r;
-
-    if (cl) {
-      tprintf("revoking lock %lld owned by client %s.\n", task.lid, task.client.c_str());
+  if (proc == rlock_protocol::revoke) {
+    p.revoke.push_back(lid);
+  } else {
+    p.retry.push_back(lid);
+  }
 
-      cl->call(rlock_protocol::revoke, task.lid, (lock_protocol::xid_t) 0 /* xid */, r);
-    }
+  if (!p.busy) {
+    p.busy = true;
+    ready_q.enq(client);
   }
 }
 
 void
-lock_server_cache_rsm::retryer()
+lock_server_cache_rsm::notifier()
 {
-  task_t task;
+  std::string client;
 
   while (true) {
-    retry_tasks.deq(&task);
+    ready_q.deq(&client);
 
-    if (!rsm->amiprimary()) { // only primary is allowed to contact client.
-      continue;
-    }
+    // Keep sending to this client until nothing is left for it.
+    while (true) {
+      std::vector<lock_protocol::lockid_t> revoke, retry;
 
-    handle h(task.client);
-    rpcc *cl = h.safebind();
-    int r;
+      {
+        ScopedLock ml(&pending_m);
 
-    if (cl) {
-      tprintf("retry lock %lld for client %s.\n", task.lid, task.client.c_str());
+        pending_t &p = pending[client];
+        if (p.revoke.empty() && p.retry.empty()) {
+          pending.erase(client);
+          break;
+        }
+        revoke.swap(p.revoke);
+        retry.swap(p.retry);
+      }
 
-      cl->call(rlock_protocol::retry, task.lid, (lock_protocol::xid_t) 0 /* xid */, r);
+      if (!rsm->amiprimary()) { // only primary is allowed to contact client.
+        continue;
+      }
+
+      if (!revoke.empty()) {
+        send(client, rlock_protocol::revoke, revoke);
+      }
+      if (!retry.empty()) {
+        send(client, rlock_protocol::retry, retry);
+      }
     }
   }
 }
 
+void
+lock_server_cache_rsm::send(const std::string &client, unsigned int proc,
+                            const std::vector<lock_protocol::lockid_t> &lids)
+{
+  handle h(client);
+  rpcc *cl = h.safebind();
+  int r;
+
+  if (!cl) {
+    return;
+  }
+
+  tprintf("%s %zu lock(s) for client %s.\n",
+          proc == rlock_protocol::revoke ? "revoking" : "retrying",
+          lids.size(), client.c_str());
+
+  if (lids.size() == 1) {
+    cl->call(proc, lids[0], (lock_protocol::xid_t) 0 /* xid */, r);
+  } else {
+    cl->call(proc == rlock_protocol::revoke ? rlock_protocol::revoke_multi
+                                            : rlock_protocol::retry_multi,
+             lids, (lock_protocol::xid_t) 0 /* xid */, r);
+  }
+}
+
 // TODO: The server should discard out-of-date requests, but *must* reply
 // consistently if the request is a duplication of the latest request from the
 // same client.
@@ -95,10 +133,52 @@ lock_server_cache_rsm::retryer()
 lock_protocol::status
 lock_server_cache_rsm::acquire(lock_protocol::lockid_t lid, std::string id,
                                lock_protocol::xid_t xid, int &r)
+{
+  return acquire_impl(lid, id, xid, false /* shared */, r);
+}
+
+lock_protocol::status
+lock_server_cache_rsm::acquire_shared(lock_protocol::lockid_t lid, std::string id,
+                                      lock_protocol::xid_t xid, int &r)
+{
+  return acquire_impl(lid, id, xid, true /* shared */, r);
+}
+
+// Returns OK if all locks were granted and RETRY if some were not; the
+// client gets a retry for each of those as usual.
+lock_protocol::status
+lock_server_cache_rsm::acquire_multi(std::vector<lock_protocol::lockid_t> lids,
+                                     std::string id, lock_protocol::xid_t xid,
+                                     std::map<lock_protocol::lockid_t, int> &r)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    int waiting = 0;
+    lock_protocol::status s = acquire_impl(lids[i], id, xid, false /* shared */, waiting);
+
+    if (s == lock_protocol::OK) {
+      r[lids[i]] = waiting;
+    } else if (ret == lock_protocol::OK || s != lock_protocol::RETRY) {
+      ret = s;
+    }
+  }
+
+  return ret;
+}
+
+// A shared lock is lent to every client that asks for it while no client
+// holds or waits for the lock exclusively. A client that asks for an
+// exclusive lock has the lock revoked from its owner or from all readers;
+// readers that come after it wait until it is done.
+lock_protocol::status
+lock_server_cache_rsm::acquire_impl(lock_protocol::lockid_t lid, std::string id,
+                                    lock_protocol::xid_t xid, bool shared, int &r)
 {
   ScopedLock ml(&m);
 
-  tprintf("acquire request of lock %lld from client %s.\n", lid, id.c_str());
+  tprintf("acquire request of %s lock %lld from client %s.\n",
+          shared ? "shared" : "exclusive", lid, id.c_str());
 
   std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
   if (it == locks.end()) {
@@ -109,60 +189,89 @@ lock_server_cache_rsm::acquire(lock_protocol::lockid_t lid, std::string id,
   if (xid < it->second.client_ctx[id].last_xid) {
     tprintf("stale acquire request of lock %lld from client %s.\n", lid, id.c_str());
     return lock_protocol::STALE;
-  } else if (it->second.client_ctx[id].last_xid == xid) {
+  } else if (it->second.client_ctx[id].last_xid == xid &&
+             it->second.client_ctx[id].acquire_reply.status != lock_protocol::OK) {
     const acquire_reply_t &reply = it->second.client_ctx[id].acquire_reply;
 
-    if (reply.status == lock_protocol::OK) {
-      r = reply.ret;
-    }
-    if (!reply.revoke.empty()) {
-      task_t task;
-      task.lid = lid;
-      task.client = reply.revoke;
-      revoke_tasks.enq(std::move(task));
+    for (unsigned int i = 0; i < reply.revoke.size(); ++i) {
+      notify(lid, reply.revoke[i], rlock_protocol::revoke);
     }
     return reply.status;
   }
 
+  // A granted acquire that is retried, e.g. across a view change, is
+  // handled like a new one: the client may never have seen the grant,
+  // and its lease may have run out since.
   it->second.client_ctx[id].last_xid = xid;
 
   acquire_reply_t &reply = it->second.client_ctx[id].acquire_reply;
-  reply.status = lock_protocol::OK;
+  lock_t &l = it->second;
 
-  while (true) {
-    switch (it->second.status) {
-      case lock_status::free: {
-        it->second.status = lock_status::lent;
-        it->second.owner = id;
-
-        reply.ret = r = !it->second.wait_q.empty();
+  reply.status = lock_protocol::OK;
+  reply.revoke.clear();
+
+  // A client that dropped a lock whose lease was about to run out may ask
+  // for it again before the server took it back.
+  if ((!shared && l.owner == id) || (shared && l.readers.count(id) > 0)) {
+    lease(l, id);
+    reply.ret = r = !l.wait_q.empty() || l.status == lock_status::revoked ||
+                    l.status == lock_status::recalled;
+    return (reply.status = lock_protocol::OK);
+  }
 
-        tprintf("lock %lld is owned by %s now.\n", lid, it->second.owner.c_str());
+  // Likewise, a client that dropped the lock and now asks for it in the
+  // other mode no longer holds it; do not make it wait for itself.
+  if ((shared && l.owner == id) || (!shared && l.readers.count(id) > 0)) {
+    drop(lid, l, id);
+  }
 
-        return (reply.status = lock_protocol::OK);
+  switch (l.status) {
+    case lock_status::free:
+    case lock_status::shared: {
+      if (shared) {
+        l.status = lock_status::shared;
+        l.readers.insert(id);
+        tprintf("lock %lld is shared by %zu clients now.\n", lid, l.readers.size());
+      } else if (l.status == lock_status::free) {
+        l.status = lock_status::lent;
+        l.owner = id;
+        tprintf("lock %lld is owned by %s now.\n", lid, l.owner.c_str());
+      } else {
+        break;
       }
 
-      case lock_status::lent:
-      case lock_status::revoked: {
-        it->second.wait_q.push(id);
+      lease(l, id);
+      reply.ret = r = !l.wait_q.empty();
 
-        if (it->second.status == lock_status::lent) {
-          task_t task;
-          task.lid = lid;
-          task.client = it->second.owner;
-          revoke_tasks.enq(std::move(task));
+      return (reply.status = lock_protocol::OK);
+    }
 
-          it->second.status = lock_status::revoked;
+    case lock_status::lent:
+    case lock_status::revoked:
+    case lock_status::recalled:
+      break;
+  }
 
-          reply.revoke = it->second.owner;
-        }
+  l.wait_q.push(id);
+  if (shared) {
+    l.shared_q.insert(id);
+  } else {
+    l.shared_q.erase(id);
+  }
 
-        return (reply.status = lock_protocol::RETRY);
-      }
-    }
+  if (l.status == lock_status::lent) {
+    reply.revoke.push_back(l.owner);
+    l.status = lock_status::revoked;
+  } else if (l.status == lock_status::shared) {
+    reply.revoke.assign(l.readers.begin(), l.readers.end());
+    l.status = lock_status::recalled;
+  }
+
+  for (unsigned int i = 0; i < reply.revoke.size(); ++i) {
+    notify(lid, reply.revoke[i], rlock_protocol::revoke);
   }
 
-  return reply.status;
+  return (reply.status = lock_protocol::RETRY);
 }
 
 lock_protocol::status
@@ -190,29 +299,269 @@ lock_server_cache_rsm::release(lock_protocol::lockid_t lid, std::string id,
 
   release_reply_t &reply = it->second.client_ctx[id].release_reply;
 
-  if (it->second.status == lock_status::free) {
-    tprintf("lock %lld is free.\n", lid);
-    return (reply.status = lock_protocol::RPCERR);
+  return (reply.status = drop(lid, it->second, id));
+}
+
+lock_protocol::status
+lock_server_cache_rsm::stat(lock_protocol::lockid_t lid, int &r)
+{
+  ScopedLock ml(&m);
+
+  tprintf("stat request of lock %lld.\n", lid);
+
+  std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lid);
+  if (it == locks.end()) {
+    r = 0;
+  } else if (it->second.status == lock_status::shared ||
+             it->second.status == lock_status::recalled) {
+    r = it->second.readers.size();
+  } else {
+    r = it->second.status != lock_status::free;
+  }
+
+  return lock_protocol::OK;
+}
+
+// Start a new lease of lock @l for its holder @id.
+void
+lock_server_cache_rsm::lease(lock_t &l, const std::string &id)
+{
+  l.leases[id] = ++l.serial;
+  l.lease_end[id] = time(NULL) + lock_protocol::lease_time;
+}
+
+// Take lock @l back from its holder @id, and wake the waiters once no
+// client holds it.
+lock_protocol::status
+lock_server_cache_rsm::drop(lock_protocol::lockid_t lid, lock_t &l,
+                            const std::string &id)
+{
+  switch (l.status) {
+    case lock_status::free: {
+      tprintf("lock %lld is free.\n", lid);
+      return lock_protocol::RPCERR;
+    }
+
+    case lock_status::lent:
+    case lock_status::revoked: {
+      if (l.owner != id) {
+        tprintf("lock %lld is not owned by client %s.\n", lid, id.c_str());
+        return lock_protocol::RPCERR;
+      }
+      l.owner.clear();
+      break;
+    }
+
+    case lock_status::shared:
+    case lock_status::recalled: {
+      if (l.readers.erase(id) == 0) {
+        tprintf("lock %lld is not shared by client %s.\n", lid, id.c_str());
+        return lock_protocol::RPCERR;
+      }
+      break;
+    }
+  }
+
+  l.leases.erase(id);
+  l.lease_end.erase(id);
+
+  if (!l.readers.empty()) {
+    return lock_protocol::OK;
+  }
+
+  l.status = lock_status::free;
+  wake(lid, l);
+
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_server_cache_rsm::renew(std::vector<lock_protocol::lockid_t> lids,
+                             std::string id,
+                             std::vector<lock_protocol::lockid_t> &lost)
+{
+  ScopedLock ml(&m);
+
+  tprintf("renew request of %zu locks from client %s.\n", lids.size(), id.c_str());
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lids[i]);
+
+    if (it == locks.end() || it->second.leases.count(id) == 0) {
+      lost.push_back(lids[i]);
+      continue;
+    }
+    lease(it->second, id);
+  }
+
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_server_cache_rsm::expire(std::vector<lock_protocol::lockid_t> lids,
+                              std::vector<std::string> clients,
+                              std::vector<unsigned int> serials, int &)
+{
+  ScopedLock ml(&m);
+
+  VERIFY(lids.size() == clients.size() && lids.size() == serials.size());
+
+  for (unsigned int i = 0; i < lids.size(); ++i) {
+    std::map<lock_protocol::lockid_t, lock_t>::iterator it = locks.find(lids[i]);
+
+    if (it == locks.end()) {
+      continue;
+    }
+
+    std::map<std::string, unsigned int>::iterator l = it->second.leases.find(clients[i]);
+    if (l == it->second.leases.end() || l->second != serials[i]) {
+      continue; // released or renewed since
+    }
+
+    tprintf("lease of lock %lld held by client %s ran out.\n", lids[i], clients[i].c_str());
+    drop(lids[i], it->second, clients[i]);
   }
-  if (it->second.owner != id) {
-    tprintf("lock %lld is not owned by client %s.\n", lid, id.c_str());
-    return (reply.status = lock_protocol::RPCERR);
+
+  return lock_protocol::OK;
+}
+
+// Once a second, the primary takes back the locks that others wait for
+// and whose leases ran out, with one replicated expire request. Leases
+// of locks no one waits for are left alone, as taking them back would
+// gain nothing.
+void
+lock_server_cache_rsm::expirer()
+{
+  while (true) {
+    sleep(1);
+
+    if (!rsm->amiprimary()) {
+      continue;
+    }
+
+    std::vector<lock_protocol::lockid_t> lids;
+    std::vector<std::string> clients;
+    std::vector<unsigned int> serials;
+
+    {
+      ScopedLock ml(&m);
+
+      time_t now = time(NULL);
+      std::map<lock_protocol::lockid_t, lock_t>::iterator it;
+
+      for (it = locks.begin(); it != locks.end(); ++it) {
+        lock_t &l = it->second;
+
+        if (l.status != lock_status::revoked && l.status != lock_status::recalled) {
+          continue;
+        }
+
+        std::map<std::string, time_t>::iterator e;
+        for (e = l.lease_end.begin(); e != l.lease_end.end(); ++e) {
+          // Allow a second for the clocks to disagree.
+          if (e->second + 1 < now) {
+            lids.push_back(it->first);
+            clients.push_back(e->first);
+            serials.push_back(l.leases[e->first]);
+          }
+        }
+      }
+    }
+
+    if (lids.empty()) {
+      continue;
+    }
+
+    marshall req;
+    std::string rep;
+
+    req << lids << clients << serials;
+    rsm->service_invoke(lock_protocol::expire, req.str(), rep);
   }
+}
+
+// Retry the first waiter of the free lock @l, together with the readers
+// queued right behind it if it wants to read.
+void
+lock_server_cache_rsm::wake(lock_protocol::lockid_t lid, lock_t &l)
+{
+  bool first = true;
+
+  while (!l.wait_q.empty()) {
+    std::string next = l.wait_q.front();
+    bool shared = l.shared_q.count(next) > 0;
 
-  it->second.status = lock_status::free;
-  it->second.owner.clear();
+    if (!first && !shared) {
+      break;
+    }
+    l.wait_q.pop();
+    l.shared_q.erase(next);
 
-  if (!it->second.wait_q.empty()) {
-    std::string next = it->second.wait_q.front();
-    it->second.wait_q.pop();
+    notify(lid, next, rlock_protocol::retry);
 
-    task_t task;
-    task.client = std::move(next);
-    task.lid = lid;
-    retry_tasks.enq(std::move(task));
+    if (!shared) {
+      break;
+    }
+    first = false;
   }
+}
 
-  return (reply.status = lock_protocol::OK);
+void
+lock_server_cache_rsm::marshal_lock(marshall &m, lock_protocol::lockid_t lid,
+                                    const lock_t &l)
+{
+  std::map<std::string, client_context_t>::const_iterator iter_ctx;
+
+  m << lid;
+
+  m << (int) l.status;
+  m << l.owner;
+  m << std::vector<std::string>(l.readers.begin(), l.readers.end());
+  m << l.wait_q;
+  m << std::vector<std::string>(l.shared_q.begin(), l.shared_q.end());
+  m << l.serial << l.leases;
+
+  m << (int) l.client_ctx.size();
+  for (iter_ctx = l.client_ctx.begin(); iter_ctx != l.client_ctx.end(); ++iter_ctx) {
+    m << iter_ctx->first << iter_ctx->second;
+  }
+}
+
+void
+lock_server_cache_rsm::unmarshal_lock(unmarshall &u,
+                                      std::map<lock_protocol::lockid_t, lock_t> &locks)
+{
+  lock_protocol::lockid_t key;
+  int status, ctx_size;
+
+  u >> key;
+  locks[key] = lock_t();
+
+  lock_t &l = locks[key];
+
+  std::vector<std::string> readers, shared_q;
+
+  u >> status; l.status = (lock_status) status;
+  u >> l.owner;
+  u >> readers; l.readers.insert(readers.begin(), readers.end());
+  u >> l.wait_q;
+  u >> shared_q; l.shared_q.insert(shared_q.begin(), shared_q.end());
+  u >> l.serial >> l.leases;
+
+  // The leases are timed from now on this replica.
+  std::map<std::string, unsigned int>::const_iterator iter_lease;
+  for (iter_lease = l.leases.begin(); iter_lease != l.leases.end(); ++iter_lease) {
+    l.lease_end[iter_lease->first] = time(NULL) + lock_protocol::lease_time;
+  }
+
+  u >> ctx_size;
+  for (int j = 0; j < ctx_size; ++j) {
+    std::string client;
+    client_context_t ctx;
+
+    u >> client >> ctx;
+    l.client_ctx[client] = std::move(ctx);
+  }
 }
 
 std::string
@@ -222,23 +571,11 @@ lock_server_cache_rsm::marshal_state()
 
   marshall m;
   std::map<lock_protocol::lockid_t, lock_t>::const_iterator iter_lock;
-  std::map<std::string, client_context_t>::const_iterator iter_ctx;
 
   m << (int) locks.size();
 
   for (iter_lock = locks.begin(); iter_lock != locks.end(); ++iter_lock) {
-    m << iter_lock->first;
-
-    const lock_t &l = iter_lock->second;
-
-    m << (int) l.status;
-    m << l.owner;
-    m << l.wait_q;
-
-    m << (int) l.client_ctx.size();
-    for (iter_ctx = l.client_ctx.begin(); iter_ctx != l.client_ctx.end(); ++iter_ctx) {
-      m << iter_ctx->first << iter_ctx->second;
-    }
+    marshal_lock(m, iter_lock->first, iter_lock->second);
   }
 
   return m.str();
@@ -250,32 +587,65 @@ lock_server_cache_rsm::unmarshal_state(std::string state)
   ScopedLock ml(&m);
 
   unmarshall u(state);
-  int lock_size, ctx_size;
+  int lock_size;
 
   locks.clear();
 
   u >> lock_size;
   for (int i = 0; i < lock_size; ++i) {
-    lock_protocol::lockid_t key;
-    std::string elem;
-    int status;
+    unmarshal_lock(u, locks);
+  }
+}
 
-    u >> key;
-    locks[key] = lock_t();
+void
+lock_server_cache_rsm::marshal_chunk(const std::string &pos, size_t max,
+                                     std::string &chunk, std::string &next)
+{
+  ScopedLock ml(&m);
 
-    lock_t &l = locks[key];
+  marshall m;
+  std::map<lock_protocol::lockid_t, lock_t>::const_iterator iter_lock;
 
-    u >> status; l.status = (lock_status) status;
-    u >> l.owner;
-    u >> l.wait_q;
+  iter_lock = pos.empty() ? locks.begin()
+                          : locks.lower_bound(strtoull(pos.c_str(), NULL, 10));
 
-    u >> ctx_size;
-    for (int j = 0; j < ctx_size; ++j) {
-      std::string client;
-      client_context_t ctx;
+  for (; iter_lock != locks.end() && (size_t) m.size() < max; ++iter_lock) {
+    marshal_lock(m, iter_lock->first, iter_lock->second);
+  }
 
-      u >> client >> ctx;
-      l.client_ctx[client] = std::move(ctx);
-    }
+  chunk = m.str();
+  next.clear();
+  if (iter_lock != locks.end()) {
+    std::ostringstream ost;
+    ost << iter_lock->first;
+    next = ost.str();
+  }
+}
+
+void
+lock_server_cache_rsm::unmarshal_begin()
+{
+  ScopedLock ml(&m);
+  staged.clear();
+}
+
+void
+lock_server_cache_rsm::unmarshal_chunk(const std::string &chunk)
+{
+  ScopedLock ml(&m);
+
+  unmarshall u(chunk);
+
+  while (u.ok() && u.ind() < u.size()) {
+    unmarshal_lock(u, staged);
   }
+  VERIFY(u.okdone());
+}
+
+void
+lock_server_cache_rsm::unmarshal_end()
+{
+  ScopedLock ml(&m);
+  locks.swap(staged);
+  staged.clear();
 }
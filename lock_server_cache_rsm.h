@@ -3,6 +3,8 @@
 
 #include <string>
 #include <queue>
+#include <set>
+#include <vector>
 
 #include "lock_protocol.h"
 #include "rpc.h"
@@ -16,15 +18,17 @@ class lock_server_cache_rsm : public rsm_state_transfer {
   class rsm *rsm;
 
   enum lock_status {
-    free,    // server has the free lock
-    lent,    // lock is lent to some client @owner
-    revoked, // lock is lent but being revoked
+    free,     // server has the free lock
+    lent,     // lock is lent to some client @owner
+    revoked,  // lock is lent but being revoked
+    shared,   // lock is lent to the clients in @readers
+    recalled, // lock is lent to @readers but being revoked from all of them
   };
 
   struct acquire_reply_t {
     lock_protocol::status status;
     int ret;
-    std::string revoke;
+    std::vector<std::string> revoke;
   };
 
   struct release_reply_t {
@@ -56,33 +60,95 @@ class lock_server_cache_rsm : public rsm_state_transfer {
   struct lock_t {
     lock_status status;
     std::string owner;
+    std::set<std::string> readers;
     uqueue<std::string> wait_q; // waiting list
+    std::set<std::string> shared_q; // clients in wait_q that want to read
     std::map<std::string, client_context_t> client_ctx;
 
-    lock_t() : status(lock_status::free) { }
+    // Every grant or renewal gets the next serial, so that an expire
+    // decided on an older lease does nothing.
+    unsigned int serial;
+    std::map<std::string, unsigned int> leases; // holder -> serial
+
+    // When each lease runs out by the local clock. This is not part of
+    // the replicated state; only the primary acts on it.
+    std::map<std::string, time_t> lease_end;
+
+    lock_t() : status(lock_status::free), serial(0) { }
   };
   std::map<lock_protocol::lockid_t, lock_t> locks;
 
-  struct task_t {
-    lock_protocol::lockid_t lid;
-    std::string client;
+  // Revokes and retries are sent by a pool of NWORKERS threads. The work
+  // for one client is coalesced into one call per kind and sent by one
+  // worker at a time, so a slow or dead client holds up only that worker.
+  static const int NWORKERS = 8;
+
+  struct pending_t {
+    std::vector<lock_protocol::lockid_t> revoke;
+    std::vector<lock_protocol::lockid_t> retry;
+    bool busy; // queued in ready_q or being sent by a worker
+    pending_t() : busy(false) { }
   };
-  fifo<task_t> revoke_tasks;
-  fifo<task_t> retry_tasks;
+  std::map<std::string, pending_t> pending;
+  fifo<std::string> ready_q;
+  pthread_mutex_t pending_m; // protects pending, taken after m
+
+  // The state being received by chunks; it replaces locks once complete.
+  std::map<lock_protocol::lockid_t, lock_t> staged;
+
+  static void marshal_lock(marshall &, lock_protocol::lockid_t, const lock_t &);
+  static void unmarshal_lock(unmarshall &, std::map<lock_protocol::lockid_t, lock_t> &);
+
+  void lease(lock_t &, const std::string &);
+  lock_protocol::status drop(lock_protocol::lockid_t, lock_t &, const std::string &);
+
+  void notify(lock_protocol::lockid_t, const std::string &, unsigned int);
+  void send(const std::string &, unsigned int,
+            const std::vector<lock_protocol::lockid_t> &);
 
   pthread_mutex_t m;
 
+  lock_protocol::status acquire_impl(lock_protocol::lockid_t, std::string,
+                                     lock_protocol::xid_t, bool, int &);
+  void wake(lock_protocol::lockid_t, lock_t &);
+
  public:
   lock_server_cache_rsm(class rsm *rsm = 0);
 
-  void revoker();
-  void retryer();
+  void notifier();
+  void expirer();
 
   std::string marshal_state();
   void unmarshal_state(std::string state);
+  // A chunk holds the locks from id @pos on, and the next one starts at
+  // the id that follows them.
+  void marshal_chunk(const std::string &pos, size_t max,
+                     std::string &chunk, std::string &next);
+  void unmarshal_begin();
+  void unmarshal_chunk(const std::string &chunk);
+  void unmarshal_end();
 
   lock_protocol::status acquire(lock_protocol::lockid_t, std::string, lock_protocol::xid_t, int &);
+  lock_protocol::status acquire_shared(lock_protocol::lockid_t, std::string, lock_protocol::xid_t, int &);
+  // Acquire every lock in @lids in one round trip. @r tells for each
+  // granted lock whether other clients wait for it; the client is queued
+  // for the others as if it had asked for them one at a time.
+  lock_protocol::status acquire_multi(std::vector<lock_protocol::lockid_t>, std::string,
+                                      lock_protocol::xid_t,
+                                      std::map<lock_protocol::lockid_t, int> &);
   lock_protocol::status release(lock_protocol::lockid_t, std::string, lock_protocol::xid_t, int &);
+  // The number of clients lock @lid is lent to. It changes nothing, so
+  // the primary answers it without the backups.
+  lock_protocol::status stat(lock_protocol::lockid_t, int &);
+  // Extend the leases that client @id holds on @lids. @lost returns the
+  // locks the client no longer holds.
+  lock_protocol::status renew(std::vector<lock_protocol::lockid_t>, std::string,
+                              std::vector<lock_protocol::lockid_t> &lost);
+  // Take back the locks whose leases ran out: lock @lids[i] from client
+  // @clients[i] if its lease is still the one with serial @serials[i].
+  lock_protocol::status expire(std::vector<lock_protocol::lockid_t>,
+                               std::vector<std::string>,
+                               std::vector<unsigned int>, int &);
 };
 
 #endif
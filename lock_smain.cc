@@ -70,13 +70,22 @@ main(int argc, char *argv[])
   rpcs server(atoi(argv[1]));
   lock_server_cache_rsm ls;
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
+  server.reg(lock_protocol::acquire_shared, &ls, &lock_server_cache_rsm::acquire_shared);
+  server.reg(lock_protocol::acquire_multi, &ls, &lock_server_cache_rsm::acquire_multi);
   server.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
+  server.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat);
 #else
   rsm rsm(argv[1], argv[2]);
+  rsm.set_batching(32, 3);
   lock_server_cache_rsm ls(&rsm);
   rsm.set_state_transfer((rsm_state_transfer *) &ls);
   rsm.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
+  rsm.reg(lock_protocol::acquire_shared, &ls, &lock_server_cache_rsm::acquire_shared);
+  rsm.reg(lock_protocol::acquire_multi, &ls, &lock_server_cache_rsm::acquire_multi);
+  rsm.reg(lock_protocol::renew, &ls, &lock_server_cache_rsm::renew);
+  rsm.reg(lock_protocol::expire, &ls, &lock_server_cache_rsm::expire);
   rsm.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
+  rsm.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat, true);
 #endif // STEP_ONE
 #endif // RSM
 
@@ -85,6 +94,8 @@ main(int argc, char *argv[])
   rpcs server(atoi(argv[1]), count);
   server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+  server.reg(lock_protocol::acquire_shared, &ls, &lock_server_cache::acquire_shared);
+  server.reg(lock_protocol::acquire_multi, &ls, &lock_server_cache::acquire_multi);
   server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
 #endif
 
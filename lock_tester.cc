@@ -147,6 +147,79 @@ test5(void *x)
   return 0;
 }
 
+// check_shared_grant() and check_shared_release() check that a lock is
+// never held in shared and exclusive mode at the same time.
+int readers;
+int writers;
+
+void
+check_shared_grant(bool shared)
+{
+  ScopedLock ml(&count_mutex);
+  if (writers != 0 || (!shared && readers != 0)) {
+    fprintf(stderr, "error: server granted %016llx shared and exclusive\n", c);
+    fprintf(stdout, "error: server granted %016llx shared and exclusive\n", c);
+    exit(1);
+  }
+  if (shared) {
+    readers += 1;
+  } else {
+    writers += 1;
+  }
+}
+
+void
+check_shared_release(bool shared)
+{
+  ScopedLock ml(&count_mutex);
+  if (shared) {
+    readers -= 1;
+  } else {
+    writers -= 1;
+  }
+}
+
+void *
+test6(void *x)
+{
+  int i = * (int *) x;
+
+  printf ("test6: client %d acquire c shared or exclusive concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    bool shared = (i + j) % 3 != 0;
+    lc[i]->acquire(c, shared);
+    check_shared_grant(shared);
+    printf ("test6: client %d got lock %s\n", i, shared ? "shared" : "exclusive");
+    usleep(10000);
+    check_shared_release(shared);
+    lc[i]->release(c);
+  }
+  return 0;
+}
+
+void *
+test7(void *x)
+{
+  int i = * (int *) x;
+  std::vector<lock_protocol::lockid_t> lids;
+
+  lids.push_back(i % 2 ? a : b);
+  lids.push_back(i % 2 ? b : a);
+
+  printf ("test7: client %d acquire a and b at once concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    lc[i]->acquire_multi(lids);
+    check_grant(a);
+    check_grant(b);
+    printf ("test7: client %d got locks\n", i);
+    check_release(b);
+    check_release(a);
+    lc[i]->release(b);
+    lc[i]->release(a);
+  }
+  return 0;
+}
+
 static void
 force_exit(int) {
     exit(0);
@@ -178,8 +251,8 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if (test < 1 || test > 5) {
-        printf("Test number must be between 1 and 5\n");
+      if (test < 1 || test > 7) {
+        printf("Test number must be between 1 and 7\n");
         exit(1);
       }
     }
@@ -247,6 +320,40 @@ main(int argc, char *argv[])
       }
     }
 
+    if (!test || test == 6) {
+      printf("test 6\n");
+
+      // test 6: two clients hold c shared at once, then readers and
+      // writers on all clients.
+      lc[0]->acquire(c, true);
+      lc[1]->acquire(c, true);
+      lc[0]->release(c);
+      lc[1]->release(c);
+
+      for (int i = 0; i < nt; i++) {
+        int *a = new int (i);
+        r = pthread_create(&th[i], NULL, test6, (void *) a);
+        VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+        pthread_join(th[i], NULL);
+      }
+    }
+
+    if (!test || test == 7) {
+      printf("test 7\n");
+
+      // test 7
+      for (int i = 0; i < nt; i++) {
+        int *a = new int (i);
+        r = pthread_create(&th[i], NULL, test7, (void *) a);
+        VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+        pthread_join(th[i], NULL);
+      }
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
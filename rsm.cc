@@ -5,7 +5,17 @@
 // them to all backups. A backup executes requests in the order that
 // the primary stamps them and replies with an OK to the primary. The
 // primary executes the request after it receives OKs from all backups,
-// and sends the reply back to the client.
+// and sends the reply back to the client. With batching on, the primary
+// forwards concurrent requests as one batch stamped with a contiguous
+// range of sequence numbers, and may have several batches in flight;
+// backups still execute the requests in sequence number order.
+//
+// Requests to handlers registered as read-only are not replicated: the
+// primary executes them right away as long as it holds a lease on the
+// view. The lease is kept up by heartbeats from the primary to each
+// backup through the config module; a backup that answered one will not
+// take over as primary until the lease it granted has run out. Without
+// a lease, read-only requests are replicated like any other.
 //
 // The config module will tell the RSM about a new view. If the
 // primary in the previous view is a member of the new view, then it
@@ -79,6 +89,7 @@
 // The rule is that a module releases its internal locks before it
 // upcalls, but can keep its locks when calling down.
 
+#include <errno.h>
 #include <fstream>
 #include <iostream>
 #include <unistd.h>
@@ -97,8 +108,18 @@ recoverythread(void *x)
   return 0;
 }
 
+static void *
+leaserthread(void *x)
+{
+  rsm *r = (rsm *) x;
+  r->leaser();
+  return 0;
+}
+
 rsm::rsm(std::string _first, std::string _me)
   : stf(0), primary(_first), insync(false), inviewchange(true), vid_commit(0),
+    max_batch(1), max_inflight(1), failed_vid(0), log_bytes(0),
+    xfer_active(false), lease_vid(0), serve_after(0),
     partitioned (false), dopartition(false), break1(false), break2(false)
 {
   pthread_t th;
@@ -110,9 +131,13 @@ rsm::rsm(std::string _first, std::string _me)
 
   pthread_mutex_init(&rsm_mutex, NULL);
   pthread_mutex_init(&invoke_mutex, NULL);
+  pthread_cond_init(&invoke_c, NULL);
+  pthread_cond_init(&myvs_c, NULL);
   pthread_cond_init(&recovery_cond, NULL);
   pthread_cond_init(&sync_cond, NULL);
 
+  fanout = new ThrPool(NFANOUT);
+
   cfg = new config(_first, _me, this);
 
   if (_first == _me) {
@@ -126,6 +151,7 @@ rsm::rsm(std::string _first, std::string _me)
   rsmrpc->reg(rsm_protocol::invoke, this, &rsm::invoke);
   rsmrpc->reg(rsm_protocol::transferreq, this, &rsm::transferreq);
   rsmrpc->reg(rsm_protocol::transferdonereq, this, &rsm::transferdonereq);
+  rsmrpc->reg(rsm_protocol::transferchunkreq, this, &rsm::transferchunkreq);
   rsmrpc->reg(rsm_protocol::joinreq, this, &rsm::joinreq);
 
   // tester must be on different port, otherwise it may partition itself.
@@ -136,14 +162,28 @@ rsm::rsm(std::string _first, std::string _me)
   {
     ScopedLock ml(&rsm_mutex);
     VERIFY(pthread_create(&th, NULL, &recoverythread, (void *) this) == 0);
+    VERIFY(pthread_create(&th, NULL, &leaserthread, (void *) this) == 0);
   }
 }
 
 void
-rsm::reg1(int proc, handler *h)
+rsm::reg1(int proc, handler *h, bool ro)
 {
   ScopedLock ml(&rsm_mutex);
   procs[proc] = h;
+  if (ro) {
+    readonly.insert(proc);
+  }
+}
+
+void
+rsm::set_batching(unsigned int _max_batch, unsigned int _max_inflight)
+{
+  VERIFY(_max_batch > 0 && _max_inflight > 0);
+
+  ScopedLock il(&invoke_mutex);
+  max_batch = _max_batch;
+  max_inflight = _max_inflight;
 }
 
 // The recovery thread runs this function.
@@ -192,20 +232,26 @@ rsm::recovery()
 bool
 rsm::sync_with_backups()
 {
-  // TODO(fb): Is releasing rsm_mutex before acquiring invoke_mutex necessary?
-  // pthread_mutex_unlock(&rsm_mutex);
+  // Make sure that the state of lock_server_cache_rsm is stable during
+  // synchronization; otherwise, the primary's state may be more recent
+  // than replicas after the synchronization. Batches stamped after this
+  // point see inviewchange == true and fail with BUSY, so waiting for the
+  // batches in flight is enough. rsm_mutex is released meanwhile, since
+  // send_batch takes it while holding invoke_mutex.
+  VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
   {
-    // Make sure that the state of lock_server_cache_rsm is stable during
-    // synchronization; otherwise, the primary's state may be more recent
-    // than replicas after the synchronization.
-    ScopedLock ml(&invoke_mutex);
-    // By acquiring and releasing the invoke_mutex once, we make sure that
-    // the state of lock_server_cache_rsm will not be changed until all
-    // replicas are synchronized. The reason is that client_invoke arrives
-    // after this point of time will see inviewchange == true, and returns
-    // BUSY.
-  }
-  // pthread_mutex_lock(&rsm_mutex);
+    ScopedLock il(&invoke_mutex);
+    while (!inflight.empty()) {
+      pthread_cond_wait(&invoke_c, &invoke_mutex);
+    }
+  }
+  VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
+
+  // A view change committed meanwhile signalled recovery_cond while no
+  // one was waiting for it; let recovery start over for the new view.
+  if (vid_insync != vid_commit) {
+    return false;
+  }
 
   // Start accepting synchronization request (statetransferreq) now!
   tprintf("sync_with_backups: insync is true now\n");
@@ -217,10 +263,10 @@ rsm::sync_with_backups()
   backups.insert(members.begin(), members.end());
   backups.erase(cfg->myaddr());  // erase primary from backups
 
-  if (!backups.empty()) {
-    // Wait until
-    //  * all backups in view vid_insync are synchronized;
-    //  * or there is a committed viewchange.
+  // Wait until
+  //  * all backups in view vid_insync are synchronized;
+  //  * or there is a committed viewchange.
+  while (!backups.empty() && vid_insync == vid_commit) {
     pthread_cond_wait(&recovery_cond, &rsm_mutex);
   }
 
@@ -261,6 +307,7 @@ rsm::statetransfer(std::string m)
   rsm_protocol::transferres r;
   handle h(m);
   rsm_protocol::status ret;
+  viewstamp last = last_myvs;
 
   tprintf("rsm::statetransfer: contact %s w. my last_myvs(%d,%d)\n",
           m.c_str(), last_myvs.vid, last_myvs.seqno);
@@ -268,7 +315,7 @@ rsm::statetransfer(std::string m)
   VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
   rpcc *cl = h.safebind();
   if (cl) {
-    ret = cl->call(rsm_protocol::transferreq, cfg->myaddr(), last_myvs,
+    ret = cl->call(rsm_protocol::transferreq, cfg->myaddr(), last,
                    vid_insync, r, rpcc::to(1000));
   }
   VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
@@ -278,8 +325,22 @@ rsm::statetransfer(std::string m)
             (long unsigned) cl, ret);
     return false;
   }
-  if (stf && last_myvs != r.last) {
-    stf->unmarshal_state(r.state);
+  if (last_myvs != last) {
+    tprintf("rsm::statetransfer: executed requests meanwhile, try again\n");
+    return false;
+  }
+  if (r.delta) {
+    std::string rep;
+    tprintf("rsm::statetransfer: executing %zu logged requests\n", r.log.size());
+    for (unsigned int i = 0; i < r.log.size(); i++) {
+      execute(r.log[i].procno, r.log[i].req, rep);
+      log_append(r.log[i].vs, r.log[i].procno, r.log[i].req);
+    }
+  } else if (last_myvs != r.last) {
+    if (stf && !fetch_snapshot(m, r.last)) {
+      return false;
+    }
+    log_reset(r.last);
   }
   last_myvs = r.last;
   tprintf("rsm::statetransfer transfer from %s success, vs(%d,%d)\n",
@@ -287,6 +348,59 @@ rsm::statetransfer(std::string m)
   return true;
 }
 
+// Fetch the state of m as of @last chunk by chunk, resuming where an
+// earlier call for the same state stopped. Assumes that rsm_mutex is held.
+bool
+rsm::fetch_snapshot(std::string m, viewstamp last)
+{
+  handle h(m);
+
+  if (!xfer_active || xfer_last != last) {
+    stf->unmarshal_begin();
+    xfer_active = true;
+    xfer_last = last;
+    xfer_pos = "";
+  } else {
+    tprintf("rsm::fetch_snapshot: resume (%d,%d) at %s\n", last.vid,
+            last.seqno, xfer_pos.c_str());
+  }
+
+  for (unsigned int n = 1; ; n++) {
+    rsm_protocol::chunkres r;
+    rsm_protocol::status ret;
+    std::string pos = xfer_pos;
+
+    VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
+    rpcc *cl = h.safebind();
+    if (cl) {
+      ret = cl->call(rsm_protocol::transferchunkreq, cfg->myaddr(), vid_insync,
+                     last, pos, r, rpcc::to(1000));
+    }
+    VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
+
+    if (cl == NULL || ret != rsm_protocol::OK) {
+      tprintf("rsm::fetch_snapshot: chunk at %s from %s failed\n",
+              pos.c_str(), m.c_str());
+      if (cl != NULL && ret == rsm_protocol::ERR) {
+        xfer_active = false;  // that state is gone; start over next time
+      }
+      return false;
+    }
+
+    stf->unmarshal_chunk(r.chunk);
+    xfer_pos = r.next;
+    if (xfer_pos.empty()) {
+      tprintf("rsm::fetch_snapshot: (%d,%d) done after %u chunks\n",
+              last.vid, last.seqno, n);
+      break;
+    }
+  }
+
+  stf->unmarshal_end();
+  xfer_active = false;
+  return true;
+}
+
 // Inform primary that this slave has synchronized for vid_insync.
 // Assumes that rsm_mutex is already held.
 bool
@@ -361,9 +475,19 @@ rsm::commit_change_wo(unsigned vid)
   tprintf("commit_change: new view (%d)  last vs (%d,%d) %s insync %d\n",
           vid, last_myvs.vid, last_myvs.seqno, primary.c_str(), insync);
 
+  std::string old = primary;
+
   vid_commit = vid;
   inviewchange = true;
   set_primary(vid);
+
+  // The old primary may still read locally until the lease this node
+  // granted to it runs out.
+  if (primary != old && primary == cfg->myaddr()) {
+    serve_after = cfg->acked() + config::lease_time + 1;
+    tprintf("commit_change: taking over from %s after %ld\n", old.c_str(),
+            (long) serve_after);
+  }
   pthread_cond_signal(&recovery_cond);
 
   if (cfg->ismember(cfg->myaddr(), vid_commit))
@@ -396,78 +520,217 @@ rsm::execute(int procno, std::string req, std::string &r)
 rsm_client_protocol::status
 rsm::client_invoke(int procno, std::string req, std::string &r)
 {
-  viewstamp vs;
-  std::vector<std::string> members;
+  request_t q;
+  bool local;
 
   tprintf("client_invoke of procno = %d.\n", procno);
 
-  pthread_mutex_lock(&rsm_mutex);
+  {
+    ScopedLock ml(&rsm_mutex);
+
+    if (inviewchange) {
+      tprintf("client_invoke: in a view change.\n");
+      return rsm_client_protocol::BUSY;
+    }
 
-  if (inviewchange) {
-    tprintf("client_invoke: in a view change.\n");
-    pthread_mutex_unlock(&rsm_mutex);
-    return rsm_client_protocol::BUSY;
+    if (primary != cfg->myaddr()) {
+      tprintf("client_invoke: not a primary.\n");
+      return rsm_client_protocol::NOTPRIMARY;
+    }
+
+    if (time(NULL) < serve_after) {
+      tprintf("client_invoke: the old primary's lease may not be over.\n");
+      return rsm_client_protocol::BUSY;
+    }
+
+    local = readonly.count(procno) && has_lease();
+  }
+
+  // A read-only request sees every request that the primary executed,
+  // and with the lease no other node can have executed any more.
+  if (local) {
+    execute(procno, req, r);
+    return rsm_client_protocol::OK;
+  }
+
+  q.procno = procno;
+  q.req = req;
+  q.done = false;
+  q.ret = rsm_client_protocol::OK;
+
+  ScopedLock il(&invoke_mutex);
+  invoke_q.push_back(&q);
+
+  // Any waiting thread sends the next batch once there is room for it in
+  // the pipeline, whether or not that batch holds its own request.
+  while (!q.done) {
+    if (invoke_q.empty() || inflight.size() >= max_inflight) {
+      pthread_cond_wait(&invoke_c, &invoke_mutex);
+    } else {
+      send_batch();
+    }
   }
 
-  if (primary != cfg->myaddr()) {
-    tprintf("client_invoke: not a primary.\n");
-    pthread_mutex_unlock(&rsm_mutex);
-    return rsm_client_protocol::NOTPRIMARY;
+  r = q.rep;
+  return q.ret;
+}
+
+// Take up to max_batch requests from invoke_q, stamp them with the next
+// viewstamps, send them to all backups and execute them once every
+// backup has done so and all earlier batches were executed. Assumes
+// that invoke_mutex is held; it is released while waiting.
+void
+rsm::send_batch()
+{
+  batch_t b;
+  std::vector<std::string> members;
+
+  while (!invoke_q.empty() && b.procs.size() < max_batch) {
+    request_t *q = invoke_q.front();
+    invoke_q.pop_front();
+    b.waiters.push_back(q);
+    b.procs.push_back(q->procno);
+    b.reqs.push_back(q->req);
   }
 
   {
-    ScopedLock ml(&invoke_mutex);
-    int dummy_r;
+    ScopedLock ml(&rsm_mutex);
+
+    if (inviewchange || primary != cfg->myaddr()) {
+      tprintf("send_batch: no longer the primary of a stable view.\n");
+      finish_batch(b, false);
+      return;
+    }
 
     // We are definitely master (primary).
-    vs = myvs;
-    last_myvs = myvs;
-    myvs.seqno += 1;
+    b.vs = myvs;
+    myvs.seqno += b.procs.size();
 
-    members = cfg->get_view(vs.vid);
+    members = cfg->get_view(b.vs.vid);
+  }
 
-    // Release rsm_mutex once we have got invoke_mutex.
-    pthread_mutex_unlock(&rsm_mutex);
+  tprintf("send_batch: %zu requests from (%d,%d)\n", b.procs.size(),
+          b.vs.vid, b.vs.seqno);
 
-    for (const std::string &member : members) {
-      if (member == cfg->myaddr()) {
-        continue;
-      }
+  b.pending = members.size() - isamember(cfg->myaddr(), members);
+  b.ok = true;
+  inflight.push_back(&b);
+
+  // Send the batch to all backups at once, so that it takes as long as
+  // the slowest backup rather than all of them together. The jobs are
+  // queued in viewstamp order while holding invoke_mutex, so a fanout
+  // thread never waits for a batch that is still queued behind it.
+  for (const std::string &member : members) {
+    if (member != cfg->myaddr()) {
+      fanout->addObjJob(this, &rsm::invoke_backup, new fanout_job_t(&b, member));
+    }
+  }
 
-      handle h(member);
-      rpcc *cl = h.safebind();
+  while (b.pending > 0 || inflight.front() != &b) {
+    pthread_cond_wait(&invoke_c, &invoke_mutex);
+  }
+  inflight.pop_front();
 
-      if (cl == NULL ||
-          cl->call(rsm_protocol::invoke, procno, vs, req, dummy_r, rpcc::to(1000)) != rsm_protocol::OK) {
-        tprintf("client_invoke: failed to invoke slave %s.\n", member.c_str());
-        return rsm_client_protocol::BUSY;
-      }
+  // Once a batch failed, the backups do not execute any later batch of
+  // the same view, and neither does the primary.
+  if (!b.ok) {
+    failed_vid = b.vs.vid;
+  }
+  finish_batch(b, b.vs.vid != failed_vid);
+}
 
-      breakpoint1();
-      partition1();
+// Execute the requests of @b on the primary if @ok and wake up the
+// client_invoke threads waiting for them. Assumes that invoke_mutex is
+// held.
+void
+rsm::finish_batch(batch_t &b, bool ok)
+{
+  for (unsigned int i = 0; i < b.waiters.size(); i++) {
+    request_t *q = b.waiters[i];
+
+    if (ok) {
+      // Execute the request on master.
+      // FIXME (fb): execute should be protected in rsm_mutex.
+      // Consider refactoring execute by passing procs[procno] instead.
+      execute(q->procno, q->req, q->rep);
+      q->ret = rsm_client_protocol::OK;
+    } else {
+      q->ret = rsm_client_protocol::BUSY;
     }
+    q->done = true;
+  }
 
-    // Execute the request on master.
-    // FIXME (fb): execute should be protected in rsm_mutex.
-    // Consider refactoring execute by passing procs[procno] instead.
-    execute(procno, req, r);
+  if (ok) {
+    ScopedLock ml(&rsm_mutex);
+    for (unsigned int i = 0; i < b.procs.size(); i++) {
+      last_myvs = viewstamp(b.vs.vid, b.vs.seqno + i);
+      log_append(last_myvs, b.procs[i], b.reqs[i]);
+    }
   }
 
-  return rsm_client_protocol::OK;
+  pthread_cond_broadcast(&invoke_c);
+}
+
+// A fanout thread runs this to send the batch @j->b to the backup
+// @j->member.
+void
+rsm::invoke_backup(fanout_job_t *j)
+{
+  batch_t *b = j->b;
+  int dummy_r;
+  bool ok;
+
+  handle h(j->member);
+  rpcc *cl = h.safebind();
+
+  ok = cl != NULL &&
+       cl->call(rsm_protocol::invoke, b->vs, b->procs, b->reqs, dummy_r,
+                rpcc::to(1000)) == rsm_protocol::OK;
+
+  if (ok) {
+    breakpoint1();
+    partition1();
+  } else {
+    tprintf("client_invoke: failed to invoke slave %s.\n", j->member.c_str());
+  }
+
+  {
+    ScopedLock il(&invoke_mutex);
+    b->ok = b->ok && ok;
+    if (--b->pending == 0) {
+      pthread_cond_broadcast(&invoke_c);
+    }
+  }
+
+  delete j;
 }
 
 //
 // The primary calls the internal invoke at each member of the
-// replicated state machine.
+// replicated state machine with a batch of requests, stamped from @vs
+// on.
 //
 // the replica must execute requests in order (with no gaps)
 // according to requests' seqno.
 //
 rsm_protocol::status
-rsm::invoke(int proc, viewstamp vs, std::string req, int &)
+rsm::invoke(viewstamp vs, std::vector<int> procs, std::vector<std::string> reqs,
+            int &)
 {
   ScopedLock ml(&rsm_mutex);
   std::string r;
+  struct timespec deadline;
+
+  // With several batches in flight, a batch may arrive before the ones
+  // stamped earlier; give those a moment to arrive.
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 1;
+
+  while (vs.vid == myvs.vid && vs.seqno > myvs.seqno && !inviewchange) {
+    if (pthread_cond_timedwait(&myvs_c, &rsm_mutex, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
 
   if (vs != myvs) {
     tprintf("invoke: not expected viewstamp.\n");
@@ -484,12 +747,19 @@ rsm::invoke(int proc, viewstamp vs, std::string req, int &)
     return rsm_protocol::ERR;
   }
 
-  last_myvs = vs;
-  myvs.seqno += 1;
+  VERIFY(procs.size() == reqs.size());
 
-  execute(proc, req, r);
+  for (unsigned int i = 0; i < procs.size(); i++) {
+    last_myvs = myvs;
+    myvs.seqno += 1;
+
+    execute(procs[i], reqs[i], r);
+    log_append(last_myvs, procs[i], reqs[i]);
 
-  breakpoint1();
+    breakpoint1();
+  }
+
+  pthread_cond_broadcast(&myvs_c);
 
   return rsm_protocol::OK;
 }
@@ -508,12 +778,87 @@ rsm::transferreq(std::string src, viewstamp last, unsigned vid,
   if (!insync || vid != vid_insync) {
      return rsm_protocol::BUSY;
   }
-  if (stf && last != last_myvs)
-    r.state = stf->marshal_state();
+  r.delta = false;
+  if (last != last_myvs && log_suffix(last, r.log)) {
+    tprintf("transferreq: sending %zu logged requests\n", r.log.size());
+    r.delta = true;
+  }
   r.last = last_myvs;
   return ret;
 }
 
+// RPC handler: Send back the chunk of the local node's state at @pos, if
+// the state is still the one as of @last.
+rsm_protocol::status
+rsm::transferchunkreq(std::string src, unsigned vid, viewstamp last,
+                      std::string pos, rsm_protocol::chunkres &r)
+{
+  ScopedLock ml(&rsm_mutex);
+
+  if (!insync || vid != vid_insync) {
+     return rsm_protocol::BUSY;
+  }
+  if (stf == NULL || last != last_myvs) {
+    tprintf("transferchunkreq from %s: state (%d,%d) is gone\n", src.c_str(),
+            last.vid, last.seqno);
+    return rsm_protocol::ERR;
+  }
+
+  stf->marshal_chunk(pos, CHUNK_SIZE, r.chunk, r.next);
+  return rsm_protocol::OK;
+}
+
+// Log a request that this node executed. Assumes that rsm_mutex is held.
+void
+rsm::log_append(viewstamp vs, int procno, const std::string &req)
+{
+  rsm_protocol::logentry e;
+
+  e.vs = vs;
+  e.procno = procno;
+  e.req = req;
+  log.push_back(e);
+  log_bytes += req.size();
+
+  while (log.size() > MAX_LOG || log_bytes > MAX_LOG_BYTES) {
+    log_base = log.front().vs;
+    log_bytes -= log.front().req.size();
+    log.pop_front();
+  }
+}
+
+// Forget the log once the state came from elsewhere, as of @base.
+// Assumes that rsm_mutex is held.
+void
+rsm::log_reset(viewstamp base)
+{
+  log.clear();
+  log_bytes = 0;
+  log_base = base;
+}
+
+// Return the logged requests after @last in @suffix, or false if the log
+// does not reach back to @last. Assumes that rsm_mutex is held.
+bool
+rsm::log_suffix(viewstamp last, std::vector<rsm_protocol::logentry> &suffix)
+{
+  unsigned int i = log.size();
+
+  if (last != log_base) {
+    while (i > 0 && log[i - 1].vs != last) {
+      i--;
+    }
+    if (i == 0) {
+      return false;
+    }
+  } else {
+    i = 0;
+  }
+
+  suffix.assign(log.begin() + i, log.end());
+  return true;
+}
+
 // RPC handler: Inform the local node (the primary) that node m
 // has synchronized.
 rsm_protocol::status
@@ -620,6 +965,69 @@ rsm::set_primary(unsigned vid)
   VERIFY(0);
 }
 
+// The leaser thread runs this function. While this node is the primary
+// of a stable view, it renews the lease once a second.
+void
+rsm::leaser()
+{
+  std::vector<std::string> members;
+  unsigned vid;
+  time_t t;
+
+  ScopedLock ml(&rsm_mutex);
+
+  while (1) {
+    VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
+    sleep(1);
+    VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
+
+    if (inviewchange || primary != cfg->myaddr()) {
+      continue;
+    }
+    if (lease_vid != vid_commit) {
+      lease_vid = vid_commit;
+      lease_acks.clear();
+    }
+    vid = lease_vid;
+    members = cfg->get_view(vid);
+
+    for (unsigned i = 0; i < members.size(); i++) {
+      if (members[i] == cfg->myaddr()) {
+        continue;
+      }
+      t = time(NULL);
+      VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
+      bool ok = cfg->renew(members[i], vid);
+      VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
+      if (ok && lease_vid == vid) {
+        lease_acks[members[i]] = t;
+      }
+    }
+  }
+}
+
+// Whether this node, as the primary, holds a lease on view vid_commit.
+// The lease from a backup lasts lease_time seconds from when the
+// heartbeat was sent; one second less allows for the clocks' rounding.
+// Assumes that rsm_mutex is held.
+bool
+rsm::has_lease()
+{
+  std::vector<std::string> members = cfg->get_view(vid_commit);
+  time_t now = time(NULL);
+
+  for (unsigned i = 0; i < members.size(); i++) {
+    if (members[i] == cfg->myaddr()) {
+      continue;
+    }
+    if (lease_vid != vid_commit || !lease_acks.count(members[i]) ||
+        lease_acks[members[i]] + (time_t) config::lease_time - 1 <= now) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool
 rsm::amiprimary()
 {
@@ -6,18 +6,21 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <deque>
 #include "rsm_protocol.h"
 #include "rsm_state_transfer.h"
 #include "rpc.h"
+#include "thr_pool.h"
 #include <arpa/inet.h>
 #include "config.h"
 
 class rsm : public config_view_change {
  private:
-  void reg1(int proc, handler *);
+  void reg1(int proc, handler *, bool readonly);
 
  protected:
   std::map<int, handler *> procs;
+  std::set<int> readonly;  // procs that do not change the state
   config *cfg;
   class rsm_state_transfer *stf;
   rpcs *rsmrpc;
@@ -33,6 +36,71 @@ class rsm : public config_view_change {
   unsigned vid_insync;  // The view id that this node is synchronizing for
   std::set<std::string> backups;  // A list of unsynchronized backups
 
+  // Requests wait in invoke_q until a client_invoke thread takes up to
+  // max_batch of them into a batch, which gets a contiguous range of
+  // viewstamps. Up to max_inflight batches are sent to the backups at
+  // once, and the primary executes them in viewstamp order.
+  struct request_t {
+    int procno;
+    std::string req;
+    std::string rep;
+    bool done;
+    rsm_client_protocol::status ret;
+  };
+
+  struct batch_t {
+    viewstamp vs;                      // viewstamp of the first request
+    std::vector<int> procs;
+    std::vector<std::string> reqs;
+    std::vector<request_t *> waiters;
+    unsigned int pending;              // backups that have not replied yet
+    bool ok;                           // all replies so far were OK
+  };
+
+  unsigned int max_batch;
+  unsigned int max_inflight;
+  std::deque<request_t *> invoke_q;
+  std::deque<batch_t *> inflight;     // in viewstamp order
+  unsigned failed_vid;                // last view in which a batch failed
+
+  // The requests this node executed most recently, in viewstamp order,
+  // starting right after log_base. A backup whose last_myvs is log_base
+  // or one of the logged viewstamps has the same state as this node had
+  // then, and is brought up to date by executing the rest of the log.
+  // The rest of the log is sent in one reply, so the log stays well below
+  // the RPC layer's 10 MB limit on a message.
+  static const unsigned int MAX_LOG = 10000;
+  static const size_t MAX_LOG_BYTES = 4 * 1024 * 1024;
+  std::deque<rsm_protocol::logentry> log;
+  size_t log_bytes;
+  viewstamp log_base;
+
+  void log_append(viewstamp vs, int procno, const std::string &req);
+  void log_reset(viewstamp base);
+  bool log_suffix(viewstamp last, std::vector<rsm_protocol::logentry> &);
+
+  // Snapshots are sent in chunks of about CHUNK_SIZE bytes. A backup
+  // remembers how far it got, so that after a failed chunk it resumes
+  // the same snapshot (xfer_last) at xfer_pos instead of starting over.
+  static const size_t CHUNK_SIZE = 256 * 1024;
+  bool xfer_active;
+  viewstamp xfer_last;
+  std::string xfer_pos;
+
+  bool fetch_snapshot(std::string m, viewstamp last);
+
+  // The primary executes read-only requests on its own while it holds a
+  // lease on the view, i.e. while every backup answered one of its
+  // heartbeats (sent at lease_acks[m]) within the last lease_time
+  // seconds. A node that takes over as primary accepts no requests until
+  // the leases it granted have run out (serve_after), so no other
+  // primary can have executed a request that a local read misses.
+  unsigned lease_vid;
+  std::map<std::string, time_t> lease_acks;
+  time_t serve_after;
+
+  bool has_lease();
+
   // For testing purposes
   rpcs *testsvr;
   bool partitioned;
@@ -42,16 +110,36 @@ class rsm : public config_view_change {
 
   rsm_client_protocol::status client_members(int i, std::vector<std::string> &r);
 
-  rsm_protocol::status invoke(int proc, viewstamp vs, std::string mreq, int &dummy);
+  rsm_protocol::status invoke(viewstamp vs, std::vector<int> procs,
+                              std::vector<std::string> reqs, int &dummy);
   rsm_protocol::status transferreq(std::string src, viewstamp last, unsigned vid, rsm_protocol::transferres &r);
   rsm_protocol::status transferdonereq(std::string m, unsigned vid, int &);
+  rsm_protocol::status transferchunkreq(std::string src, unsigned vid, viewstamp last,
+                                        std::string pos, rsm_protocol::chunkres &r);
   rsm_protocol::status joinreq(std::string src, viewstamp last, rsm_protocol::joinres &r);
 
+  // The primary sends a batch to all backups at once from a pool of
+  // fanout threads, and waits for every one of them to reply.
+  static const int NFANOUT = 8;
+  ThrPool *fanout;
+
+  struct fanout_job_t {
+    batch_t *b;
+    std::string member;
+    fanout_job_t(batch_t *b, std::string member) : b(b), member(member) { }
+  };
+
+  void send_batch();
+  void finish_batch(batch_t &, bool ok);
+  void invoke_backup(fanout_job_t *);
+
   rsm_test_protocol::status test_net_repairreq(int heal, int &r);
   rsm_test_protocol::status breakpointreq(int b, int &r);
 
   pthread_mutex_t rsm_mutex;
-  pthread_mutex_t invoke_mutex;
+  pthread_mutex_t invoke_mutex;  // protects the request queue and batches
+  pthread_cond_t invoke_c;
+  pthread_cond_t myvs_c;         // signalled when a backup advances myvs
   pthread_cond_t recovery_cond;
   pthread_cond_t sync_cond;
 
@@ -80,28 +168,48 @@ class rsm : public config_view_change {
   ~rsm() { }
 
   bool amiprimary();
+  // Replicate and execute a request that the service makes on its own,
+  // e.g. from a timer on the primary. @req holds the marshalled arguments.
+  rsm_client_protocol::status service_invoke(int procno, std::string req,
+                                             std::string &r) {
+    return client_invoke(procno, req, r);
+  }
   void set_state_transfer(rsm_state_transfer *_stf) { stf = _stf; }
+  // Let the primary replicate up to @max_batch requests as one batch and
+  // have up to @max_inflight batches in flight. The default of one each
+  // replicates one request at a time. A backup holds an RPC thread while
+  // a batch waits for the ones before it, so keep @max_inflight small.
+  void set_batching(unsigned int max_batch, unsigned int max_inflight);
   void recovery();
+  void leaser();
   void commit_change(unsigned vid);
 
+  // A @readonly handler must not change the state; the primary may
+  // execute it without sending it to the backups.
   template<class S, class A1, class R>
-  void reg(int proc, S*, int (S::*meth)(const A1 a1, R &));
+  void reg(int proc, S*, int (S::*meth)(const A1 a1, R &),
+           bool readonly = false);
 
   template<class S, class A1, class A2, class R>
-  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, R &));
+  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, R &),
+           bool readonly = false);
 
   template<class S, class A1, class A2, class A3, class R>
-  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R &));
+  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R &),
+           bool readonly = false);
 
   template<class S, class A1, class A2, class A3, class A4, class R>
-  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R &));
+  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R &),
+           bool readonly = false);
 
   template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, const A5 a5, R &));
+  void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, const A5 a5, R &),
+           bool readonly = false);
 };
 
 template<class S, class A1, class R> void
-rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r),
+         bool readonly)
 {
   class h1 : public handler {
    private:
@@ -123,11 +231,12 @@ rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
     }
   };
 
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new h1(sob, meth), readonly);
 }
 
 template<class S, class A1, class A2, class R> void
-rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r))
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r),
+         bool readonly)
 {
   class h1 : public handler {
    private:
@@ -151,11 +260,12 @@ rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r))
     }
   };
 
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new h1(sob, meth), readonly);
 }
 
 template<class S, class A1, class A2, class A3, class R> void
-rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r))
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r),
+         bool readonly)
 {
   class h1 : public handler {
    private:
@@ -181,11 +291,12 @@ rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3,
     }
   };
 
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new h1(sob, meth), readonly);
 }
 
 template<class S, class A1, class A2, class A3, class A4, class R> void
-rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r))
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r),
+         bool readonly)
 {
   class h1 : public handler {
    private:
@@ -213,11 +324,12 @@ rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3,
     }
   };
 
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new h1(sob, meth), readonly);
 }
 
 template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, const A5 a5, R & r))
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, const A5 a5, R & r),
+         bool readonly)
 {
   class h1 : public handler {
    private:
@@ -246,7 +358,7 @@ rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, const A3 a3,
     }
   };
 
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new h1(sob, meth), readonly);
 }
 
 #endif /* rsm_h */
@@ -0,0 +1,137 @@
+//
+// Replicated state machine benchmark
+//
+// Runs acquire/release pairs from 1, 2, 4, ... threads through one
+// rsm_client and prints the throughput and the latency of the replicated
+// operations for each thread count. Every thread uses a lock of its own,
+// so no request waits for another client and each operation costs one
+// round through the primary and its backups. With "read", the threads
+// ask for the status of their locks instead, which the primary answers
+// on its own. Run it against a running lock_server RSM; rsm_bench.sh
+// starts one with 3 and 5 replicas.
+//
+
+#include "lock_protocol.h"
+#include "rsm_client.h"
+#include "gettime.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "lang/verify.h"
+
+rsm_client *rsmc;
+int seconds = 3;
+bool reads;
+volatile bool done;
+
+struct worker_t {
+  lock_protocol::lockid_t lid;
+  std::string id;
+  std::vector<double> lat;  // latency of each operation in microseconds
+};
+
+static double
+now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void *
+worker(void *x)
+{
+  worker_t *w = (worker_t *) x;
+  lock_protocol::xid_t xid = 0;
+  int r;
+
+  while (!done && reads) {
+    double t0 = now_us();
+    VERIFY(rsmc->call(lock_protocol::stat, w->lid, r) == lock_protocol::OK);
+    w->lat.push_back(now_us() - t0);
+  }
+
+  while (!done && !reads) {
+    double t0 = now_us();
+    VERIFY(rsmc->call(lock_protocol::acquire, w->lid, w->id, ++xid, r) == lock_protocol::OK);
+    double t1 = now_us();
+    VERIFY(rsmc->call(lock_protocol::release, w->lid, w->id, ++xid, r) == lock_protocol::OK);
+    double t2 = now_us();
+
+    w->lat.push_back(t1 - t0);
+    w->lat.push_back(t2 - t1);
+  }
+
+  return 0;
+}
+
+void
+run(int nt)
+{
+  pthread_t th[nt];
+  worker_t w[nt];
+  std::vector<double> lat;
+  double sum = 0;
+
+  done = false;
+  for (int i = 0; i < nt; i++) {
+    std::ostringstream ost;
+    ost << "rsm_bench-" << getpid() << "-" << nt << "-" << i;
+    w[i].lid = 1 + i;
+    w[i].id = ost.str();
+    VERIFY(pthread_create(&th[i], NULL, worker, (void *) &w[i]) == 0);
+  }
+
+  sleep(seconds);
+  done = true;
+
+  for (int i = 0; i < nt; i++) {
+    pthread_join(th[i], NULL);
+    lat.insert(lat.end(), w[i].lat.begin(), w[i].lat.end());
+  }
+
+  VERIFY(!lat.empty());
+  std::sort(lat.begin(), lat.end());
+  for (unsigned int i = 0; i < lat.size(); i++) {
+    sum += lat[i];
+  }
+
+  fprintf(stderr, "%7d %10.0f %9.2f %9.2f %9.2f\n", nt,
+          lat.size() / (double) seconds, sum / lat.size() / 1000,
+          lat[lat.size() / 2] / 1000, lat[lat.size() * 99 / 100] / 1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int max_nt = 16;
+
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: %s [host:]port [max-threads] [read]\n", argv[0]);
+    exit(1);
+  }
+
+  if (argc > 2) {
+    max_nt = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    reads = std::string(argv[3]) == "read";
+  }
+
+  // The client logs every RPC; keep that out of the measurement.
+  VERIFY(freopen("/dev/null", "w", stdout) != NULL);
+  rsmc = new rsm_client(argv[1]);
+
+  fprintf(stderr, "%d seconds per run, latency in ms\n", seconds);
+  fprintf(stderr, "threads      ops/s      mean       p50       p99\n");
+
+  for (int nt = 1; nt <= max_nt; nt *= 2) {
+    run(nt);
+  }
+
+  return 0;
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+
+# Run rsm_bench against a lock_server RSM of 3 and then 5 replicas.
+# Usage: ./rsm_bench.sh [max-threads] [read]
+
+MAX_NT=${1:-16}
+
+for n in 3 5; do
+    BASE_PORT=$RANDOM
+    BASE_PORT=$[BASE_PORT+2000]
+
+    pids=""
+    x=0
+    while [ $x -lt $n ]; do
+      # rsm uses port+1 for its test server.
+      port=$[BASE_PORT+2*x]
+      ./lock_server $BASE_PORT $port > rsm_bench-$port.log 2>&1 &
+      pids="$pids $!"
+      x=$[x+1]
+      sleep 1
+    done
+    # Let the last joins commit.
+    sleep 2
+
+    echo "$n replicas"
+    ./rsm_bench $BASE_PORT $MAX_NT $2
+
+    kill $pids
+    wait $pids 2>/dev/null
+    x=0
+    while [ $x -lt $n ]; do
+      port=$[BASE_PORT+2*x]
+      rm -f rsm_bench-$port.log paxos-$port.log
+      x=$[x+1]
+    done
+done
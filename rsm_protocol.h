@@ -33,11 +33,29 @@ class rsm_protocol {
     transferreq,
     transferdonereq,
     joinreq,
+    transferchunkreq,
   };
 
+  // A request as executed by a replica, kept to bring backups that
+  // missed only a few requests up to date.
+  struct logentry {
+    viewstamp vs;
+    int procno;
+    std::string req;
+  };
+
+  // If delta is set, the caller brings itself up to date by executing
+  // the requests in log; otherwise it fetches the state as of last with
+  // transferchunkreq, one chunk at a time.
   struct transferres {
-    std::string state;
     viewstamp last;
+    bool delta;
+    std::vector<logentry> log;
+  };
+
+  struct chunkres {
+    std::string chunk;
+    std::string next;  // position of the next chunk, "" after the last
   };
 
   struct joinres {
@@ -71,19 +89,55 @@ inline unmarshall& operator>>(unmarshall &u, viewstamp &v)
   return u;
 }
 
+inline marshall &
+operator<<(marshall &m, const rsm_protocol::logentry &e)
+{
+  m << e.vs;
+  m << e.procno;
+  m << e.req;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, rsm_protocol::logentry &e)
+{
+  u >> e.vs;
+  u >> e.procno;
+  u >> e.req;
+  return u;
+}
+
 inline marshall &
 operator<<(marshall &m, rsm_protocol::transferres r)
 {
-  m << r.state;
   m << r.last;
+  m << r.delta;
+  m << r.log;
   return m;
 }
 
 inline unmarshall &
 operator>>(unmarshall &u, rsm_protocol::transferres &r)
 {
-  u >> r.state;
   u >> r.last;
+  u >> r.delta;
+  u >> r.log;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const rsm_protocol::chunkres &r)
+{
+  m << r.chunk;
+  m << r.next;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, rsm_protocol::chunkres &r)
+{
+  u >> r.chunk;
+  u >> r.next;
   return u;
 }
 
@@ -1,13 +1,48 @@
 #ifndef rsm_state_transfer_h
 #define rsm_state_transfer_h
 
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
 #include <string>
 
 class rsm_state_transfer {
  public:
   virtual std::string marshal_state() = 0;
   virtual void unmarshal_state(std::string) = 0;
+
+  // A recovering replica fetches the state in chunks. marshal_chunk sets
+  // @chunk to about @max bytes of the state that follows position @pos,
+  // the first chunk being at "", and @next to the position after it, or
+  // to "" after the last chunk. The state does not change while it is
+  // being sent. The receiver calls unmarshal_begin, unmarshal_chunk for
+  // each chunk in order, and unmarshal_end, which replaces the state;
+  // until then the old state stays in place. The defaults cut the result
+  // of marshal_state at byte offsets.
+  virtual void marshal_chunk(const std::string &pos, size_t max,
+                             std::string &chunk, std::string &next) {
+    std::string state = marshal_state();
+    size_t off = pos.empty() ? 0 : strtoull(pos.c_str(), NULL, 10);
+
+    chunk = state.substr(std::min(off, state.size()), max);
+    next.clear();
+    if (off + chunk.size() < state.size()) {
+      std::ostringstream ost;
+      ost << off + chunk.size();
+      next = ost.str();
+    }
+  }
+  virtual void unmarshal_begin() { staged.clear(); }
+  virtual void unmarshal_chunk(const std::string &chunk) { staged += chunk; }
+  virtual void unmarshal_end() {
+    unmarshal_state(staged);
+    staged.clear();
+  }
+
   virtual ~rsm_state_transfer() { }
+
+ private:
+  std::string staged;
 };
 
 #endif
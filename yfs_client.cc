@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -10,6 +11,24 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+// Release @lid, retrying until the lock client manages. STALE means that
+// the lock was lost while held, and that what was done under it was
+// discarded rather than written back.
+template <typename L>
+static void
+release_lock(L *lc, lock_protocol::lockid_t lid, bool flush = false)
+{
+  lock_protocol::status ret;
+
+  while ((ret = lc->release(lid, flush)) != lock_protocol::OK) {
+    if (ret == lock_protocol::STALE) {
+      printf("yfs_client: lock %llu was lost, its changes are discarded.\n", lid);
+      return;
+    }
+    printf("yfs_client: releasing lock failed, try again.\n");
+  }
+}
+
 // RAII for yfs distributed lock.
 template <typename L>
 class scoped_lock_impl {
@@ -19,49 +38,133 @@ class scoped_lock_impl {
   bool flush;
 
  public:
-  scoped_lock_impl(L *lc, lock_protocol::lockid_t lid, bool flush = false)
+  scoped_lock_impl(L *lc, lock_protocol::lockid_t lid, bool flush = false,
+                   bool shared = false)
     : lc(lc), lid(lid), flush(flush) {
-    while (lc->acquire(lid) != lock_protocol::OK) {
+    while (lc->acquire(lid, shared) != lock_protocol::OK) {
       printf("yfs_client: acquiring lock failed, try again.\n");
     }
   }
 
   ~scoped_lock_impl() {
-    while (lc->release(lid, flush) != lock_protocol::OK) {
-      printf("yfs_client: releasing lock failed, try again.\n");
+    release_lock(lc, lid, flush);
+  }
+};
+
+// Read-only operations take the lock in shared mode, so that many clients
+// can cache it at the same time and only writers revoke it.
+template <typename L>
+class scoped_shared_lock_impl : public scoped_lock_impl<L> {
+ public:
+  scoped_shared_lock_impl(L *lc, lock_protocol::lockid_t lid)
+    : scoped_lock_impl<L>(lc, lid, false /* flush */, true /* shared */) { }
+};
+
+// Several locks taken in increasing order, those not cached with a single
+// round trip to the lock server.
+template <typename L>
+class scoped_multi_lock_impl {
+ private:
+  L *lc;
+  std::vector<lock_protocol::lockid_t> lids;
+
+ public:
+  scoped_multi_lock_impl(L *lc, const std::vector<lock_protocol::lockid_t> &lids)
+    : lc(lc), lids(lids) {
+    while (lc->acquire_multi(lids) != lock_protocol::OK) {
+      printf("yfs_client: acquiring locks failed, try again.\n");
+    }
+  }
+
+  ~scoped_multi_lock_impl() {
+    for (unsigned int i = 0; i < lids.size(); ++i) {
+      release_lock(lc, lids[i]);
     }
   }
 };
 
 #ifdef RSM
 using scoped_lock = scoped_lock_impl<lock_client_cache_rsm>;
+using scoped_shared_lock = scoped_shared_lock_impl<lock_client_cache_rsm>;
+using scoped_multi_lock = scoped_multi_lock_impl<lock_client_cache_rsm>;
 #else
 using scoped_lock = scoped_lock_impl<lock_client_cache>;
+using scoped_shared_lock = scoped_shared_lock_impl<lock_client_cache>;
+using scoped_multi_lock = scoped_multi_lock_impl<lock_client_cache>;
 #endif
 
 class lock_release_user_impl : public lock_release_user {
  public:
-  lock_release_user_impl(extent_client *ec) : ec(ec) { }
+  lock_release_user_impl(extent_client *ec, yfs_invalidate_user *iu)
+    : ec(ec), iu(iu) { }
 
   virtual void dorelease(lock_protocol::lockid_t id) {
     VERIFY(ec->flush(id) == extent_protocol::OK);
+
+    // Directory buckets are only read under their directory's lock.
+    if (iu != NULL && (id >> 32) == 0) {
+      iu->invalidate(id);
+    }
+  }
+
+  virtual void dodiscard(lock_protocol::lockid_t id) {
+    ec->discard(id);
+
+    if (iu != NULL && (id >> 32) == 0) {
+      iu->invalidate(id);
+    }
   }
 
  private:
   extent_client *ec;
+  yfs_invalidate_user *iu;
+};
+
+// Evicting an extent from the cache returns its lock early, which flushes
+// the extent through lock_release_user_impl.
+template <typename L>
+class extent_lock_user_impl : public extent_lock_user {
+ public:
+  extent_lock_user_impl(L *lc) : lc(lc) { }
+
+  virtual bool evict(extent_protocol::extentid_t id) {
+    return lc->release_early(id) == lock_protocol::OK;
+  }
+
+  virtual bool try_lock(extent_protocol::extentid_t id) {
+    return lc->try_acquire(id) == lock_protocol::OK;
+  }
+
+  virtual void unlock(extent_protocol::extentid_t id) {
+    release_lock(lc, id);
+  }
+
+ private:
+  L *lc;
 };
 
-yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
-  : generator(time(NULL)), distribution(2, (1u << 31) - 1)
+yfs_client::yfs_client(std::string extent_dst, std::string lock_dst,
+                       size_t cache_budget, unsigned int writeback_age,
+                       size_t dirty_limit, yfs_invalidate_user *iu)
+  : lease_next(0), lease_end(0)
 {
-  // It will cause disaster if we run two concurrent yfs_clients with the same seed!
-  // TODO: GC.
-  ec = new extent_client(extent_dst);
+  pthread_mutex_init(&m, NULL);
+
+  ec = new extent_client(extent_dst, cache_budget);
 #ifdef RSM
-  lc = new lock_client_cache_rsm(lock_dst, new lock_release_user_impl(ec));
+  lc = new lock_client_cache_rsm(lock_dst, new lock_release_user_impl(ec, iu));
+  ec->set_lock_user(new extent_lock_user_impl<lock_client_cache_rsm>(lc));
 #else
-  lc = new lock_client_cache(lock_dst, new lock_release_user_impl(ec));
+  lc = new lock_client_cache(lock_dst, new lock_release_user_impl(ec, iu));
+  ec->set_lock_user(new extent_lock_user_impl<lock_client_cache>(lc));
 #endif
+  ec->start_writeback(writeback_age, dirty_limit);
+}
+
+extent_client::cache_stats
+yfs_client::cache_stats()
+{
+  return ec->stats();
 }
 
 yfs_client::inum
@@ -81,11 +184,33 @@ yfs_client::filename(inum inum)
   return ost.str();
 }
 
-// Pray that we have no collision!
-yfs_client::inum
-yfs_client::new_inum(bool is_file)
+const extent_protocol::extentid_t yfs_client::INUM_COUNTER;
+const unsigned int yfs_client::INUM_LEASE;
+const yfs_client::inum yfs_client::INUM_FIRST;
+
+yfs_client::status
+yfs_client::new_inum(bool is_file, inum &ino)
 {
-  return distribution(generator) | (is_file ? 0x80000000 : 0x0);
+  ScopedLock ml(&m);
+
+  if (lease_next == lease_end) {
+    unsigned long long first;
+
+    if (ec->reserve(INUM_COUNTER, INUM_LEASE, first) != extent_protocol::OK) {
+      return IOERR;
+    }
+    lease_next = INUM_FIRST + first;
+    lease_end = lease_next + INUM_LEASE;
+  }
+
+  // Files and directories share the numbers below the file bit.
+  if (lease_next >= 0x80000000) {
+    printf("yfs_client: out of inode numbers\n");
+    return IOERR;
+  }
+
+  ino = lease_next++ | (is_file ? 0x80000000 : 0x0);
+  return OK;
 }
 
 bool
@@ -105,7 +230,7 @@ yfs_client::isdir(inum inum)
 yfs_client::status
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
-  scoped_lock sl(lc, inum);
+  scoped_shared_lock sl(lc, inum);
   yfs_client::status r = OK;
 
   printf("getfile %016llx\n", inum);
@@ -128,7 +253,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
 yfs_client::status
 yfs_client::getdir(inum inum, dirinfo &din)
 {
-  scoped_lock sl(lc, inum);
+  scoped_shared_lock sl(lc, inum);
   yfs_client::status r = OK;
 
   printf("getdir %016llx\n", inum);
@@ -145,113 +270,211 @@ yfs_client::getdir(inum inum, dirinfo &din)
   return r;
 }
 
+const unsigned long long yfs_client::MAX_FILE_SIZE;
+
 yfs_client::status
-yfs_client::read(inum inum, size_t size, off_t offset, std::string &output)
+yfs_client::read(inum inum, size_t size, off_t offset, extent_buf &output)
 {
   if (!isfile(inum)) {
     return NOENT;
   }
 
-  scoped_lock sl(lc, inum);
+  // Nothing lies beyond MAX_FILE_SIZE.
+  if (offset < 0 || (unsigned long long) offset >= MAX_FILE_SIZE) {
+    output = extent_buf();
+    return OK;
+  }
+  size = std::min((unsigned long long) size, MAX_FILE_SIZE - offset);
 
-  extent_protocol::status status;
-  std::string buf;
+  scoped_shared_lock sl(lc, inum);
 
-  status = ec->get(inum, buf);
-  if (status != OK) {
-    return status;
+  return ec->read_range(inum, offset, size, output);
+}
+
+yfs_client::status
+yfs_client::write(inum inum, const char *input, size_t size, off_t offset)
+{
+  if (!isfile(inum)) {
+    return NOENT;
   }
 
-  // Adjust the size to read of fit the file.
-  if (offset >= (off_t) buf.size()) {
-    size = 0;
-  } else {
-    size = std::min(size, buf.size() - offset);
+  if (offset < 0 || size > MAX_FILE_SIZE ||
+      (unsigned long long) offset > MAX_FILE_SIZE - size) {
+    return FBIG;
   }
 
-  output = buf.substr(offset, size);
+  scoped_lock sl(lc, inum);
 
-  return OK;
+  return ec->write_range(inum, offset, std::string(input, size));
 }
 
 yfs_client::status
-yfs_client::write(inum inum, const char *input, size_t size, off_t offset)
+yfs_client::setattr(inum inum, size_t size)
 {
   if (!isfile(inum)) {
     return NOENT;
   }
 
+  if (size > MAX_FILE_SIZE) {
+    return FBIG;
+  }
+
   scoped_lock sl(lc, inum);
 
-  extent_protocol::status status;
-  std::string buf;
+  return ec->resize(inum, size);
+}
 
-  status = ec->get(inum, buf);
-  if (status != OK) {
-    return status;
-  }
+//
+// Directories are linear hash tables. The directory extent holds a small
+// header, and the entries live in bucket extents, each a marshalled map
+// from name to inum:
+//
+//   header:   magic, level, split, count
+//   bucket b: extent (dir << 32) + b + 1, guarded by its own lock
+//
+// Bucket b of 2^level + split buckets holds the names whose hash h has
+// h % 2^level == b, or h % 2^(level+1) == b if that is below split. When
+// the average load exceeds MAX_LOAD, bucket split is split into itself and
+// split + 2^level, so every create or unlink touches the header and one or
+// two buckets no matter how large the directory is.
+//
+// Directories in the old "/name_1/inum_1/.../name_n/inum_n" format are
+// migrated the first time they are used.
+//
 
-  // Grow the file if necessary.
-  if (buf.size() < size + offset) {
-    buf.resize(size + offset);
-  }
+const unsigned int yfs_client::DIR_MAGIC;
+const unsigned int yfs_client::MAX_LOAD;
 
-  for (size_t i = 0; i < size; ++i) {
-    buf[offset + i] = input[i];
-  }
+// FNV-1a
+unsigned int
+yfs_client::dir_hash(const std::string &name)
+{
+  unsigned int h = 2166136261u;
 
-  return ec->put(inum, buf);
+  for (size_t i = 0; i < name.size(); ++i) {
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+  }
+  return h;
 }
 
-yfs_client::status
-yfs_client::setattr(inum inum, size_t size)
+unsigned int
+yfs_client::dirhdr::bucket(const std::string &name) const
 {
-  if (!isfile(inum)) {
-    return NOENT;
+  unsigned int h = dir_hash(name);
+  unsigned int b = h & ((1u << level) - 1);
+
+  if (b < split) {
+    b = h & ((2u << level) - 1);
   }
+  return b;
+}
 
-  scoped_lock sl(lc, inum);
+yfs_client::inum
+yfs_client::bucket_id(inum dir, unsigned int b)
+{
+  return (dir << 32) + b + 1;
+}
 
-  extent_protocol::status status;
+yfs_client::status
+yfs_client::get_bucket(inum bid, std::map<std::string, inum> &ents)
+{
   std::string buf;
+  extent_protocol::status ret;
 
-  status = ec->get(inum, buf);
-  if (status != OK) {
-    return status;
+  ret = ec->get(bid, buf);
+  if (ret != extent_protocol::OK) {
+    return ret;
   }
 
-  buf.resize(size);
+  unmarshall u(buf);
+  ents.clear();
+  u >> ents;
 
-  return ec->put(inum, buf);
+  return u.okdone() ? OK : IOERR;
 }
 
-//
-// The directory content is stored in the following format:
-//  /file_1/inum_1/file_2/inum_2/.../file_n/inum_n.
-//
+yfs_client::status
+yfs_client::put_bucket(inum bid, const std::map<std::string, inum> &ents)
+{
+  marshall m;
+  m << ents;
+  return ec->put(bid, m.str());
+}
 
 yfs_client::status
-yfs_client::readdir(inum parent, std::vector<dirent> &ents)
+yfs_client::put_header(inum dir, const dirhdr &h)
 {
-  if (!isdir(parent)) {
-    return NOENT;
+  marshall m;
+  m << DIR_MAGIC << h.level << h.split << h.count;
+  return ec->put(dir, m.str());
+}
+
+// Write @ents as a directory of the smallest power-of-two size that keeps
+// the load below MAX_LOAD. The caller holds the lock on @dir.
+yfs_client::status
+yfs_client::init_dir(inum dir, const std::vector<dirent> &ents, dirhdr &h)
+{
+  std::vector<std::map<std::string, inum> > buckets;
+  status ret;
+
+  h.level = 0;
+  h.split = 0;
+  h.count = ents.size();
+  while ((MAX_LOAD << h.level) < h.count) {
+    h.level += 1;
   }
 
-  scoped_lock sl(lc, parent);
+  buckets.resize(1u << h.level);
+  for (unsigned int i = 0; i < ents.size(); ++i) {
+    buckets[h.bucket(ents[i].name)][ents[i].name] = ents[i].inum;
+  }
+
+  std::vector<lock_protocol::lockid_t> lids;
+
+  for (unsigned int b = 0; b < buckets.size(); ++b) {
+    lids.push_back(bucket_id(dir, b));
+  }
+
+  scoped_multi_lock sl_b(lc, lids);
+
+  for (unsigned int b = 0; b < buckets.size(); ++b) {
+    ret = put_bucket(bucket_id(dir, b), buckets[b]);
+    if (ret != OK) {
+      return ret;
+    }
+  }
+
+  return put_header(dir, h);
+}
 
-  extent_protocol::status status;
+// Read the header of @dir, migrating an old-format directory. The caller
+// holds the lock on @dir.
+yfs_client::status
+yfs_client::get_header(inum dir, dirhdr &h)
+{
+  extent_protocol::status ret;
   std::string buf;
 
-  status = ec->get(parent, buf);
-  if (status != OK) {
-    return status;
+  ret = ec->get(dir, buf);
+  if (ret != extent_protocol::OK) {
+    return ret;
   }
 
-  ents.clear();
+  if (!buf.empty() && buf[0] != '/') {
+    unmarshall u(buf);
+    unsigned int magic;
+
+    u >> magic >> h.level >> h.split >> h.count;
+    if (!u.okdone() || magic != DIR_MAGIC) {
+      return IOERR;  // corrupted data
+    }
+    return OK;
+  }
 
+  std::vector<dirent> ents;
   size_t last_slash = 0;
 
-  while (true) {
+  while (last_slash < buf.size()) {
     size_t slash_1, slash_2;
 
     slash_1 = buf.find("/", last_slash + 1);
@@ -270,36 +493,227 @@ yfs_client::readdir(inum parent, std::vector<dirent> &ents)
 
     ents.emplace_back(std::move(ent));
 
-    if (slash_2 == buf.size()) {
-      break;
+    last_slash = slash_2;
+  }
+
+  printf("yfs_client: migrating directory %016llx with %zu entries\n",
+         dir, ents.size());
+
+  return init_dir(dir, ents, h);
+}
+
+// Make sure @dir is in the bucketed format, so that readers holding only a
+// shared lock never have to migrate it. The caller holds no lock on @dir.
+yfs_client::status
+yfs_client::migrate_dir(inum dir)
+{
+  {
+    scoped_shared_lock sl(lc, dir);
+    extent_protocol::status ret;
+    std::string buf;
+
+    ret = ec->get(dir, buf);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    if (!buf.empty() && buf[0] != '/') {
+      return OK;
+    }
+  }
+
+  scoped_lock sl(lc, dir);
+  dirhdr h;
+
+  return get_header(dir, h);
+}
+
+// Split one bucket once the directory is loaded beyond MAX_LOAD. The
+// caller holds the lock on @dir and writes the header back.
+yfs_client::status
+yfs_client::grow_dir(inum dir, dirhdr &h)
+{
+  if (h.count <= (MAX_LOAD << h.level) + MAX_LOAD * h.split) {
+    return OK;
+  }
+
+  unsigned int src = h.split;
+  unsigned int dst = h.split + (1u << h.level);
+
+  std::vector<lock_protocol::lockid_t> lids;
+
+  lids.push_back(bucket_id(dir, src));
+  lids.push_back(bucket_id(dir, dst));
+
+  scoped_multi_lock sl_b(lc, lids);
+
+  std::map<std::string, inum> ents, moved;
+  std::map<std::string, inum>::iterator it;
+  status ret;
+
+  ret = get_bucket(bucket_id(dir, src), ents);
+  if (ret != OK) {
+    return ret;
+  }
+
+  h.split += 1;
+  if (h.split == (1u << h.level)) {
+    h.level += 1;
+    h.split = 0;
+  }
+
+  for (it = ents.begin(); it != ents.end(); ) {
+    if (h.bucket(it->first) == dst) {
+      moved.insert(*it);
+      ents.erase(it++);
     } else {
-      last_slash = slash_2;
+      ++it;
+    }
+  }
+
+  ret = put_bucket(bucket_id(dir, dst), moved);
+  if (ret != OK) {
+    return ret;
+  }
+  return put_bucket(bucket_id(dir, src), ents);
+}
+
+yfs_client::status
+yfs_client::readdir(inum parent, std::vector<dirent> &ents)
+{
+  if (!isdir(parent)) {
+    return NOENT;
+  }
+
+  dirhdr h;
+  status ret;
+
+  ret = migrate_dir(parent);
+  if (ret != OK) {
+    return ret;
+  }
+
+  scoped_shared_lock sl(lc, parent);
+
+  ret = get_header(parent, h);
+  if (ret != OK) {
+    return ret;
+  }
+
+  ents.clear();
+
+  for (unsigned int b = 0; b < h.nbuckets(); ++b) {
+    scoped_shared_lock sl_b(lc, bucket_id(parent, b));
+
+    std::map<std::string, inum> bucket;
+    std::map<std::string, inum>::iterator it;
+
+    ret = get_bucket(bucket_id(parent, b), bucket);
+    if (ret != OK) {
+      return ret;
+    }
+
+    for (it = bucket.begin(); it != bucket.end(); ++it) {
+      dirent ent;
+
+      ent.name = it->first;
+      ent.inum = it->second;
+      ents.emplace_back(std::move(ent));
     }
   }
 
   return OK;
 }
 
+yfs_client::status
+yfs_client::readdirplus(inum parent, std::vector<direntplus> &ents)
+{
+  std::vector<dirent> names;
+  status ret;
+
+  ret = readdir(parent, names);
+  if (ret != OK) {
+    return ret;
+  }
+
+  std::vector<extent_protocol::extentid_t> ids;
+  std::map<extent_protocol::extentid_t, extent_protocol::attr> attrs;
+  std::map<extent_protocol::extentid_t, extent_protocol::attr>::iterator it;
+
+  for (unsigned int i = 0; i < names.size(); ++i) {
+    ids.push_back(names[i].inum);
+  }
+  if (ec->getattr_multi(ids, attrs) != extent_protocol::OK) {
+    return IOERR;
+  }
+
+  ents.clear();
+
+  for (unsigned int i = 0; i < names.size(); ++i) {
+    direntplus ent;
+
+    ent.name = std::move(names[i].name);
+    ent.inum = names[i].inum;
+
+    // An entry the servers do not know yet was created by a client that
+    // has not written it back. Its lock is not taken, which would make
+    // that client write it back; its attributes are left zero.
+    it = attrs.find(ent.inum);
+    if (it != attrs.end()) {
+      ent.info.size = it->second.size;
+      ent.info.atime = it->second.atime;
+      ent.info.mtime = it->second.mtime;
+      ent.info.ctime = it->second.ctime;
+    } else {
+      ent.info.size = 0;
+      ent.info.atime = ent.info.mtime = ent.info.ctime = 0;
+    }
+    ents.emplace_back(std::move(ent));
+  }
+
+  return OK;
+}
+
 // Return OK if found.
 yfs_client::status
 yfs_client::lookup(inum parent, const char *name, inum &child)
 {
-  std::vector<dirent> ents;
-  yfs_client::status status;
+  if (!isdir(parent)) {
+    return NOENT;
+  }
+
+  dirhdr h;
+  status ret;
 
-  status = readdir(parent, ents);
-  if (status != OK) {
-    return status;
+  ret = migrate_dir(parent);
+  if (ret != OK) {
+    return ret;
   }
 
-  for (std::vector<dirent>::iterator it = ents.begin(); it != ents.end(); ++it) {
-    if (it->name == name) {
-      child = it->inum;
-      return OK;
-    }
+  scoped_shared_lock sl(lc, parent);
+
+  ret = get_header(parent, h);
+  if (ret != OK) {
+    return ret;
+  }
+
+  inum bid = bucket_id(parent, h.bucket(name));
+  scoped_shared_lock sl_b(lc, bid);
+
+  std::map<std::string, inum> bucket;
+  std::map<std::string, inum>::iterator it;
+
+  ret = get_bucket(bid, bucket);
+  if (ret != OK) {
+    return ret;
   }
 
-  return NOENT;
+  it = bucket.find(name);
+  if (it == bucket.end()) {
+    return NOENT;
+  }
+
+  child = it->second;
+  return OK;
 }
 
 yfs_client::status
@@ -311,31 +725,61 @@ yfs_client::create(inum parent, bool is_file, const char *name, inum &child)
 
   scoped_lock sl(lc, parent);
 
-  extent_protocol::status status;
-  std::string buf;
+  dirhdr h;
+  status ret;
 
-  status = ec->get(parent, buf);
-  if (status != OK) {
-    return status;
+  ret = get_header(parent, h);
+  if (ret != OK) {
+    return ret;
   }
 
-  if (buf.find(std::string("/") + name + "/") != std::string::npos) {
-    return EXIST;
-  }
+  {
+    inum bid = bucket_id(parent, h.bucket(name));
+    scoped_lock sl_b(lc, bid);
 
-  child = new_inum(is_file);
+    std::map<std::string, inum> bucket;
 
-  status = ec->put(child, "");
-  if (status != OK) {
-    return status;
-  }
+    ret = get_bucket(bid, bucket);
+    if (ret != OK) {
+      return ret;
+    }
 
-  buf.append("/");
-  buf.append(name);
-  buf.append("/");
-  buf.append(filename(child));
+    if (bucket.find(name) != bucket.end()) {
+      return EXIST;
+    }
+
+    ret = new_inum(is_file, child);
+    if (ret != OK) {
+      return ret;
+    }
+
+    {
+      scoped_lock sl_c(lc, child);
+
+      if (is_file) {
+        ret = ec->put(child, "");
+      } else {
+        dirhdr ch;
+        ret = init_dir(child, std::vector<dirent>(), ch);
+      }
+      if (ret != OK) {
+        return ret;
+      }
+    }
+
+    bucket[name] = child;
+    ret = put_bucket(bid, bucket);
+    if (ret != OK) {
+      return ret;
+    }
+  }
 
-  return ec->put(parent, buf);
+  h.count += 1;
+  ret = grow_dir(parent, h);
+  if (ret != OK) {
+    return ret;
+  }
+  return put_header(parent, h);
 }
 
 yfs_client::status
@@ -348,37 +792,56 @@ yfs_client::unlink(inum parent, const char *name)
 
   scoped_lock sl(lc, parent);
 
-  extent_protocol::status status;
-  std::string buf;
+  dirhdr h;
+  status ret;
 
-  status = ec->get(parent, buf);
-  if (status != OK) {
-    return status;
+  ret = get_header(parent, h);
+  if (ret != OK) {
+    return ret;
   }
 
-  size_t file_begin = buf.find(std::string("/") + name + "/");
-  size_t file_mid, file_end;
+  {
+    inum bid = bucket_id(parent, h.bucket(name));
+    scoped_lock sl_b(lc, bid);
 
-  if (file_begin == std::string::npos) {
-    return NOENT;
-  }
-  file_mid = file_begin + strlen(name) + 2;
-  file_end = buf.find("/", file_mid);
-  if (file_end == std::string::npos) {
-    file_end = buf.size();
-  }
+    std::map<std::string, inum> bucket;
+    std::map<std::string, inum>::iterator it;
 
-  inum inum = n2i(buf.substr(file_mid, file_end - file_mid));
+    ret = get_bucket(bid, bucket);
+    if (ret != OK) {
+      return ret;
+    }
 
-  // Flush the deleted file (i.e. return the lock to server).
-  // Otherwise the deleted file will lost tracking.
-  scoped_lock sl_2(lc, inum, true /* flush */);
+    it = bucket.find(name);
+    if (it == bucket.end()) {
+      return NOENT;
+    }
 
-  status = ec->remove(inum);
-  if (status != OK) {
-    return status;
+    inum inum = it->second;
+
+    if (isdir(inum)) {
+      return IOERR;
+    }
+
+    {
+      // Flush the deleted file (i.e. return the lock to server).
+      // Otherwise the deleted file will lost tracking.
+      scoped_lock sl_2(lc, inum, true /* flush */);
+
+      ret = ec->remove(inum);
+      if (ret != OK) {
+        return ret;
+      }
+    }
+
+    bucket.erase(it);
+    ret = put_bucket(bid, bucket);
+    if (ret != OK) {
+      return ret;
+    }
   }
 
-  buf.erase(file_begin, file_end - file_begin);
-  return ec->put(parent, buf);
+  // Buckets are not merged again; an emptied directory keeps its size.
+  h.count -= 1;
+  return put_header(parent, h);
 }
@@ -5,7 +5,7 @@
 // #include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
-#include <random>
+#include <map>
 #include <memory>
 
 #include "lock_protocol.h"
@@ -16,6 +16,17 @@
 #include "lock_client_cache.h"
 #endif
 
+// Classes that inherit yfs_invalidate_user are told when the client gives
+// up the lock on an inode, so that they can drop what they cached about it
+// while the lock was held (e.g. the kernel's attribute and dentry caches).
+// invalidate is called with the lock client's mutex held and must not
+// block on file system operations.
+class yfs_invalidate_user {
+ public:
+  virtual void invalidate(unsigned long long inum) = 0;
+  virtual ~yfs_invalidate_user() { }
+};
+
 class yfs_client {
  private:
   extent_client *ec;
@@ -26,12 +37,13 @@ class yfs_client {
   lock_client_cache *lc;
 #endif
 
-  std::default_random_engine generator;
-  std::uniform_int_distribution<int> distribution;
+  // The FUSE loop calls in from several threads. Each call holds the
+  // locks of the inodes it works on, m only protects the inum lease.
+  pthread_mutex_t m;
 
  public:
   typedef unsigned long long inum;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, FBIG };
   typedef int status;
 
   struct fileinfo {
@@ -49,14 +61,62 @@ class yfs_client {
     std::string name;
     yfs_client::inum inum;
   };
+  struct direntplus {
+    std::string name;
+    yfs_client::inum inum;
+    fileinfo info;
+  };
 
  private:
   std::string filename(inum);
   inum n2i(std::string);
-  inum new_inum(bool);
+  status new_inum(bool, inum &);
+
+  // Inode numbers are handed out from a range leased from a counter on
+  // the extent server, so they are unique across clients and most creates
+  // need no RPC to pick one. Numbers left in a lease when the client
+  // exits are never used.
+  static const extent_protocol::extentid_t INUM_COUNTER = 0;
+  static const unsigned int INUM_LEASE = 1024;
+  static const inum INUM_FIRST = 2;  // 1 is the root directory
+  inum lease_next;
+  inum lease_end;
+
+  // Directory layout, see yfs_client.cc.
+  static const unsigned int DIR_MAGIC = 0x79646972; // "ydir"
+  static const unsigned int MAX_LOAD = 64;          // entries per bucket
+
+  // Extent offsets and sizes are 32 bits, so files cannot grow larger.
+  static const unsigned long long MAX_FILE_SIZE = 0xffffffffULL;
+
+  struct dirhdr {
+    unsigned int level;
+    unsigned int split;
+    unsigned int count;
+
+    unsigned int nbuckets() const { return (1u << level) + split; }
+    unsigned int bucket(const std::string &name) const;
+  };
+
+  static unsigned int dir_hash(const std::string &);
+  static inum bucket_id(inum dir, unsigned int b);
+
+  status get_bucket(inum bid, std::map<std::string, inum> &);
+  status put_bucket(inum bid, const std::map<std::string, inum> &);
+  status get_header(inum dir, dirhdr &);
+  status migrate_dir(inum dir);
+  status put_header(inum dir, const dirhdr &);
+  status init_dir(inum dir, const std::vector<dirent> &, dirhdr &);
+  status grow_dir(inum dir, dirhdr &);
 
  public:
-  yfs_client(std::string, std::string);
+  yfs_client(std::string, std::string,
+             size_t cache_budget = extent_client::DEFAULT_BUDGET,
+             unsigned int writeback_age = extent_client::DEFAULT_WRITEBACK_AGE,
+             size_t dirty_limit = extent_client::DEFAULT_DIRTY_LIMIT,
+             yfs_invalidate_user *iu = NULL);
+
+  extent_client::cache_stats cache_stats();
 
   bool isfile(inum);
   bool isdir(inum);
@@ -64,11 +124,19 @@ class yfs_client {
   status getfile(inum, fileinfo &);
   status getdir(inum, dirinfo &);
 
-  status read(inum, size_t, off_t, std::string &);
+  // @output shares the cached file content, no copy is made.
+  status read(inum, size_t, off_t, extent_buf &);
+  // write and setattr return FBIG if the file would exceed MAX_FILE_SIZE.
   status write(inum, const char *, size_t, off_t);
   status setattr(inum, size_t);  // Only set size.
 
   status readdir(inum, std::vector<dirent> &);
+  // Like readdir, but also returns the attributes of the entries, fetched
+  // in one RPC per extent server instead of taking every entry's lock.
+  // The attributes are a snapshot for listing and may lag behind writes
+  // another client has not yet written back; they are zero for entries
+  // the servers do not know yet.
+  status readdirplus(inum, std::vector<direntplus> &);
   status lookup(inum, const char *, inum &);
   status create(inum, bool, const char *, inum &);
 